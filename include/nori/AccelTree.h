@@ -4,7 +4,12 @@
 #pragma once
 
 #include <nori/mesh.h>
+#include <nori/transform.h>
+#include <nori/RayPacket.h>
+#include <nori/RayBatch.h>
+#include <Eigen/Geometry>
 #include <vector>
+#include <tbb/spin_mutex.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -17,20 +22,64 @@ public:
         /// Initializes an invalid TriInd
         TriInd(): mesh(-1), i(-1) {};
 
-        TriInd(std::size_t meshInd, uint32_t triInd): mesh(meshInd), i(triInd) {};
+        TriInd(std::size_t meshInd, uint32_t triInd): mesh((uint32_t)meshInd), i(triInd) {};
 
         // Returns if this is a valid TriInd (IE: would be invalid if a ray didn't hit a Triangle)
         bool isValid() const
         {
-            return (mesh != (std::size_t)-1) || (i != (uint32_t)-1);
+            return (mesh != (uint32_t)-1) || (i != (uint32_t)-1);
         }
 
         /// The index of the mesh within the "meshes" vector containing this triangle.
-        std::size_t mesh;
+        uint32_t mesh;
         /// The index of the triangle within the given mesh.
         uint32_t i;
     };
 
+    /// A triangle stored directly in the data structure (one vertex and two edges),
+    ///     so an intersection test needs no index lookups into the meshes.
+    struct TriAccel
+    {
+        TriAccel() = default;
+
+        TriAccel(const Mesh* mesh, uint32_t index)
+        {
+            const MatrixXf &V = mesh->getVertexPositions();
+            const MatrixXu &F = mesh->getIndices();
+            p0 = V.col(F(0, index));
+            edge1 = Point3f(V.col(F(1, index))) - p0;
+            edge2 = Point3f(V.col(F(2, index))) - p0;
+        }
+
+        /// Moeller-Trumbore, matching Mesh::rayIntersect() exactly.
+        bool rayIntersect(const Ray3f &ray, float &u, float &v, float &t) const
+        {
+            Vector3f pvec = ray.d.cross(edge2);
+
+            float det = edge1.dot(pvec);
+            if (det > -1e-8f && det < 1e-8f)
+                return false;
+            float inv_det = 1.0f / det;
+
+            Vector3f tvec = ray.o - p0;
+            u = tvec.dot(pvec) * inv_det;
+            if (u < 0.0 || u > 1.0)
+                return false;
+
+            Vector3f qvec = tvec.cross(edge1);
+            v = ray.d.dot(qvec) * inv_det;
+            if (v < 0.0 || u + v > 1.0)
+                return false;
+
+            t = edge2.dot(qvec) * inv_det;
+
+            return t >= ray.mint && t <= ray.maxt;
+        }
+
+        Point3f p0;
+        Vector3f edge1, edge2;
+    };
+
 public:
     virtual ~AccelTree() = default;
 
@@ -42,14 +91,38 @@ public:
      */
     void addMesh(Mesh *mesh);
 
+    /**
+     * \brief Register an instance of a triangle mesh, placed in the scene by toWorld
+     *
+     * Only supported by structures that instance meshes instead of copying them
+     * (such as \ref TwoLevelBVH). Others throw a NoriException.
+     * This function can only be used before \ref build() is called
+     */
+    virtual void addInstance(Mesh *mesh, const Transform &toWorld);
+
+    /// Returns the object-to-world transform of the instance that tri (as returned by
+    ///     rayIntersect) belongs to, or nullptr if its triangle is already in world space.
+    virtual const Transform *getInstanceTransform(const TriInd &tri) const { return nullptr; }
+
     /// Internally builds the acceleration data structure, after all
     ///     meshes have been added.
     /// May only be called once.
     virtual void build() = 0;
 
+    /// Updates the data structure after the vertices of its meshes moved (with the same
+    ///     triangles, see \ref Mesh::setVertexPositions()), keeping its topology.
+    /// Only supported by some structures (others throw a NoriException).
+    /// Must be called after \ref build().
+    virtual void refit();
+
     /// Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const { return bbox; }
 
+    /// Whether to store a precomputed TriAccel for every triangle reference (in leaf order).
+    /// Speeds up intersection, but costs sizeof(TriAccel) per stored triangle.
+    /// Must be set before \ref build() is called.
+    void setPrecomputeTris(bool precompute) { if (!built) precomputeTris = precompute; }
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene and
      * return detailed intersection information
@@ -72,14 +145,94 @@ public:
      */
     virtual TriInd rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const = 0;
 
+    /**
+     * \brief Intersect every ray of a packet against all triangles stored in the scene
+     *
+     * By default, the rays are simply traced one at a time. Structures that can share
+     * one traversal between the (coherent) rays of a packet override this.
+     *
+     * \param packet
+     *    The rays to trace
+     *
+     * \param its
+     *    An array of packet.size intersection records, one per ray
+     *
+     * \param tris
+     *    An array of packet.size TriInds, which will hold the intersected triangle
+     *    of each ray (or an invalid TriInd if it hit nothing)
+     *
+     * \param shadowRay
+     *    \c true if these are shadow ray queries
+     */
+    virtual void rayIntersectPacket(const RayPacket &packet, Intersection *its, TriInd *tris,
+                                    bool shadowRay) const;
+
+    /**
+     * \brief Intersect every ray of a (possibly large) batch against all triangles
+     * stored in the scene
+     *
+     * By default, the rays are simply traced one at a time. Structures that can
+     * filter groups of rays through their nodes together override this.
+     *
+     * \param rays
+     *    The rays to trace
+     *
+     * \param its
+     *    An array of rays.size intersection records, one per ray.
+     *    May be nullptr for shadow ray queries.
+     *
+     * \param tris
+     *    An array of rays.size TriInds, which will hold the intersected triangle
+     *    of each ray (or an invalid TriInd if it hit nothing)
+     *
+     * \param shadowRay
+     *    \c true if these are shadow ray queries
+     */
+    virtual void rayIntersectBatch(const RayBatch &rays, Intersection *its, TriInd *tris,
+                                   bool shadowRay) const;
+
 protected:
 
     bool triIntersects(const BoundingBox3f& bb, const TriInd& tri);
 
+    /// Returns the bounding box of the part of a triangle that lies within box
+    ///     (an invalid box if the triangle misses it), by clipping the triangle to its six planes.
+    BoundingBox3f clippedTriBB(const TriInd& tri, const BoundingBox3f& box) const;
+
+    /// Appends the triangles of a new leaf to leafTris. Safe to call from parallel builds.
+    /// \param tris The triangles of the leaf
+    /// \return The index of the leaf's first triangle within leafTris
+    uint32_t addLeafTris(const std::vector<TriInd>& tris);
+
+    /// Fills triAccels from leafTris (if enabled). Called once leafTris is final.
+    void buildTriAccels();
+
+    /// Recomputes bbox from the (possibly moved) meshes, and refills triAccels (if present).
+    /// Called by refit().
+    void refitMeshes();
+
+    /// Intersects a ray with the triangle leafTris[ref], using its TriAccel if present.
+    bool leafTriIntersect(uint32_t ref, const Ray3f &ray, float &u, float &v, float &t) const
+    {
+        if (!triAccels.empty())
+            return triAccels[ref].rayIntersect(ray, u, v, t);
+
+        const TriInd &idx = leafTris[ref];
+        return meshes[idx.mesh]->rayIntersect(idx.i, ray, u, v, t);
+    }
+
 protected:
     std::vector<Mesh*>  meshes;         ///< Meshes within the data structure
     BoundingBox3f       bbox;           ///< Bounding box of the entire scene
 
+    /// The triangles referenced by all leaves. Each leaf only stores its (contiguous) range.
+    std::vector<TriInd> leafTris;
+    tbb::spin_mutex     leafTrisMutex;  ///< Guards leafTris during parallel construction
+
+    /// Precomputed triangles, parallel to leafTris. Empty unless precomputeTris is set.
+    std::vector<TriAccel> triAccels;
+    bool                precomputeTris = false;
+
     bool                built = false;
 };
 
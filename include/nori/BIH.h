@@ -0,0 +1,103 @@
+//
+// A bounding interval hierarchy: a binary tree whose nodes only store two clip planes along
+//     their split axis (the upper bound of the first child, and the lower bound of the second).
+//
+
+#pragma once
+
+#include "nori/BVH.h"
+
+NORI_NAMESPACE_BEGIN
+
+class BIH: public AccelTree
+{
+public:
+    /// The size of the traversal stack (at most one entry is pushed per level).
+    static constexpr int STACK_SIZE = BVH::STACK_SIZE;
+
+public:
+    /// A compact node (12 bytes). The two children of an interior node are stored next to each
+    ///     other, and the first child lies below clip[0] along the split axis, while the
+    ///     second lies above clip[1] (the two may overlap).
+    struct Node
+    {
+        /// The value of flags' lowest 2 bits for leaves (otherwise they hold the split axis).
+        static constexpr uint32_t LEAF = 3;
+
+        static Node leaf(uint32_t first, uint32_t count)
+        {
+            Node n;
+            n.first = first;
+            n.clip[1] = 0;
+            n.flags = (count << 2) | LEAF;
+            return n;
+        }
+
+        static Node interior(int axis, float lowMax, float highMin, uint32_t children)
+        {
+            Node n;
+            n.clip[0] = lowMax;
+            n.clip[1] = highMin;
+            n.flags = (children << 2) | (uint32_t)axis;
+            return n;
+        }
+
+        bool isLeaf() const
+        {
+            return (flags & 3) == LEAF;
+        }
+
+        int axis() const
+        {
+            return (int)(flags & 3);
+        }
+
+        /// Interior: the index of the first child (the second follows it)
+        uint32_t children() const
+        {
+            return flags >> 2;
+        }
+
+        /// Leaf: the number of triangles (starting at leafTris[first])
+        uint32_t triCount() const
+        {
+            return flags >> 2;
+        }
+
+        union
+        {
+            /// Interior: the upper bound of the first child, and the lower bound of the second
+            float clip[2];
+            /// Leaf: the index of the first triangle within leafTris
+            uint32_t first;
+        };
+        /// Bits 0-1: the split axis (or LEAF). Bits 2-31: children() or triCount().
+        uint32_t flags;
+    };
+
+public:
+    /// \param method The BVH split method used to split each node's triangles: BVH::SAHBuckets or
+    ///     BVH::SAHFull. (LBVH and SBVH build whole trees at once, so they fall back to SAHBuckets.)
+    BIH(BVH::SplitMethod method = BVH::SAHBuckets) :
+        AccelTree(), m_method(method == BVH::SAHFull ? BVH::SAHFull : BVH::SAHBuckets) {};
+
+    void build() override;
+
+    TriInd rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const override;
+
+private:
+    /// Recursively builds nodes[index] over splitter.leafTris[start, end), which is split (and
+    ///     partitioned in place) by the BVH's split code. Each interior node keeps its children's
+    ///     bounds along one axis: the one whose clip planes leave the children the least surface
+    ///     area (within clipBB, the node's implicit box).
+    /// \param bb The AABB bounding the triangles.
+    void build(BVH& splitter, uint32_t index, const BoundingBox3f& bb, const BoundingBox3f& clipBB,
+               uint32_t start, uint32_t end, int depth);
+
+    /// The flattened hierarchy (root at index 0).
+    std::vector<Node> nodes;
+
+    BVH::SplitMethod m_method;
+};
+
+NORI_NAMESPACE_END
@@ -6,10 +6,17 @@
 
 #include "nori/AccelTree.h"
 
+#include <atomic>
+
 NORI_NAMESPACE_BEGIN
 
 class BVH: public AccelTree
 {
+    /// Wide BVHs are collapsed from the nodes of a built BVH (and a BIH reuses its split code)
+    friend class QBVH;
+    friend class BVH8;
+    friend class BIH;
+
 public:
     ///The upper bound for triangles in a node that stops the node from subdividing.
     static constexpr std::size_t FEW_TRIS = 10;
@@ -21,16 +28,53 @@ public:
 
     /// The number of buckets in a SAH bucket-based construction
     static constexpr std::size_t BUCKETS = 12;
+    /// Nodes with at least this many triangles are binned in parallel.
+    static constexpr uint32_t PARALLEL_BIN_TRIS = 16384;
+
+    /// The most triangles in a leaf of a linear (Morton-code) BVH.
+    static constexpr uint32_t LBVH_LEAF_TRIS = 4;
+    /// The depth at which a linear BVH stops splitting (its splits are not balanced, unlike SAH's).
+    static constexpr int LBVH_MAX_DEPTH = 48;
+    /// Linear BVH ranges with at least this many triangles build their children in parallel.
+    static constexpr uint32_t LBVH_PARALLEL_TRIS = 4096;
+
+    /// The number of bins for the spatial splits of an SBVH.
+    static constexpr int SBVH_SPATIAL_BINS = 32;
+    /// Spatial splits are only tried if the best object split's children overlap by more
+    ///     than this fraction of the root's surface area.
+    static constexpr float SBVH_ALPHA = 1e-5f;
+    /// The most references an SBVH may add by splitting triangles (as a fraction of the triangle count).
+    static constexpr float SBVH_DUPLICATION = 0.3f;
+
+    /// The number of leaves of the treelets that are restructured after a build (2^7 subsets).
+    static constexpr int TREELET_LEAVES = 7;
+    /// The number of bottom-up treelet restructuring passes over the whole tree.
+    static constexpr int TREELET_ROUNDS = 3;
+
+    /// Subtrees down to this depth are refit in parallel.
+    static constexpr int REFIT_PARALLEL_DEPTH = 12;
+
+    /// The most triangles a single LinearNode leaf can reference.
+    static constexpr std::size_t MAX_LEAF_TRIS = 0xFFFF;
+    /// The size of the traversal stack (must exceed the depth of the flattened tree).
+    static constexpr int STACK_SIZE = 64;
+    /// The number of rays of a batch that are filtered through the tree together.
+    static constexpr uint32_t STREAM_SIZE = 256;
 
 public:
-    enum SplitMethod{SAHFull, SAHBuckets};
+    /// LBVH sorts the triangles along a Morton curve instead of evaluating SAH,
+    ///     which builds much faster but gives slower trees.
+    /// SBVH also considers spatial (KD-Tree style) splits, which split the references of
+    ///     triangles that straddle them, so children overlap less.
+    enum SplitMethod{SAHFull, SAHBuckets, LBVH, SBVH};
 
     /// A node for the BVH, which contains 2 children, stores its own AABB,
-    ///     and a vector of triangle indices.
+    ///     and the range of its triangles within leafTris.
     struct Node
     {
-        Node(BoundingBox3f bb, std::vector<TriInd>* triangles, int d):
-                AABB(bb), tris(triangles), dim(d)
+        /// Creates a node over the triangles leafTris[start, end). A dim of -1 makes a leaf.
+        Node(BoundingBox3f bb, uint32_t start, uint32_t end, int d):
+                AABB(bb), triStart(start), triEnd(end), dim(d)
         {
             children[0] = nullptr;
             children[1] = nullptr;
@@ -42,13 +86,12 @@ public:
             {
                 delete c;
             }
-            delete tris;
 
         }
 
         bool isLeaf() const
         {
-            return tris != nullptr;
+            return dim == -1;
         }
 
         uint32_t nodeCount() const
@@ -67,37 +110,51 @@ public:
 
         uint32_t triCount() const
         {
-            if(isLeaf() && tris != nullptr) return tris->size();
-
-            uint32_t count = 0;
-            for (auto & i : children)
-            {
-                if (i != nullptr)
-                {
-                    count += i->triCount();
-                }
-            }
-
-            return count;
+            return triEnd - triStart;
         }
 
         Node* children[2];
         BoundingBox3f AABB;
-        //The indices of the triangles in the mesh. If nullptr this is not a leaf node
-        std::vector<TriInd>* tris;
+        /// The triangles of a leaf are leafTris[triStart, triEnd). (Interior nodes of
+        ///     spatial-split or restructured trees do not cover a single range.)
+        uint32_t triStart, triEnd;
 
-        /// The dimension of the split.
+        /// The dimension of the split (-1 for leaves).
         int dim;
-    };
 
-public:
-    BVH(SplitMethod method = SAHBuckets) :
-        AccelTree(), m_method(method), root(nullptr) {};
+        /// The (unnormalized) SAH cost of the subtree, used by treelet restructuring.
+        float cost = 0;
+        /// The number of interior levels below the node once flattened (0 for leaves that fit
+        ///     in one node), used by treelet restructuring to respect the traversal stack.
+        int height = 0;
+    };
 
-    ~BVH() override
+    /// A compact, pointer-free node used for traversal (32 bytes).
+    /// Nodes are stored depth-first in one array, so the first child of an interior
+    ///     node always directly follows it, and only the second child's index is stored.
+    struct LinearNode
     {
-        delete root;
-    }
+        bool isLeaf() const
+        {
+            return triCount > 0;
+        }
+
+        BoundingBox3f AABB;
+        /// Leaf: index of the first triangle in leafTris. Interior: index of the second child.
+        uint32_t offset;
+        /// The number of triangles in a leaf (0 for interior nodes).
+        uint16_t triCount;
+        /// The dimension of the split.
+        uint8_t dim;
+        /// Interior: the child shadow rays visit first (0 = the one directly after this node).
+        uint8_t occludeFirst;
+    };
+
+public:
+    /// \param optimizeTreelets Whether to restructure the tree after building it, to lower its
+    ///     SAH cost (see \ref optimizeTreelets()). Works with any split method.
+    BVH(SplitMethod method = SAHBuckets, bool optimizeTreelets = false) :
+        AccelTree(), m_method(method), m_optimizeTreelets(optimizeTreelets) {};
 
     void build() override
     {
@@ -106,67 +163,196 @@ public:
 
     void build(SplitMethod method);
 
+    /// Recomputes the bounds of every node from the moved triangles (bottom-up, in parallel),
+    ///     keeping the tree's topology. If a rebuild ratio is set and the refit tree's SAH
+    ///     cost has grown past it, the tree is rebuilt from scratch instead.
+    void refit() override;
+
+    /// Sets how much the SAH cost of a refit tree may grow (as a factor of its cost when
+    ///     it was built) before refit() rebuilds it instead. 0 (the default) never rebuilds.
+    void setRebuildRatio(float ratio) { m_rebuildRatio = ratio; }
+
     TriInd rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const override;
 
+    /// Traces all rays of the packet down the tree together. Each visited node's box is
+    ///     tested against every ray still active below it (4 at a time with SSE).
+    void rayIntersectPacket(const RayPacket &packet, Intersection *its, TriInd *tris,
+                            bool shadowRay) const override;
+
+    /// Traces the batch in streams of STREAM_SIZE rays. Each stream walks the tree once,
+    ///     and every visited node filters the list of rays that reached it through its box.
+    void rayIntersectBatch(const RayBatch &rays, Intersection *its, TriInd *tris,
+                           bool shadowRay) const override;
+
 private:
-    Node* build(const BoundingBox3f& bb, std::vector<TriInd>* tris, int depth,
+    /// Recursively builds the subtree over leafTris[start, end), partitioning that range in place.
+    Node* build(const BoundingBox3f& bb, uint32_t start, uint32_t end, int depth,
                 SplitMethod method);
 
+    /// A triangle and the Morton code of its centroid
+    struct MortonTri
+    {
+        uint64_t code;
+        TriInd tri;
+    };
+
+    /// Builds a linear BVH over all of leafTris: sorts them by the (63-bit) Morton codes of
+    ///     their centroids, then emits the hierarchy from the sorted codes.
+    Node* buildLBVH();
+
+    /// Recursively builds the linear BVH over the sorted range [start, end), splitting it
+    ///     where the highest bit that differs between its codes changes.
+    Node* buildLBVH(const std::vector<MortonTri>& sorted, uint32_t start, uint32_t end, int depth);
+
+    /// Sets the SAH cost and height of every node of the subtree n (bottom-up), and returns n's cost.
+    float computeCosts(Node* n) const;
+
+    /// One bottom-up pass of treelet restructuring (Karras & Aila) over the subtree n, which
+    ///     is at the given depth: the children of every node are optimized (in parallel) before
+    ///     the node itself. Costs and heights must be up to date.
+    void optimizeTreelets(Node* n, int depth) const;
+
+    /// Grows a treelet of up to TREELET_LEAVES subtrees below n (by opening the largest), and
+    ///     rearranges it into the topology with the lowest SAH cost. Leaves are never changed.
+    /// Arrangements that would make the tree too deep for the traversal stack are rejected.
+    void restructureTreelet(Node* n, int depth) const;
+
+    /// Stable LSD radix sort of tris by their codes, 8 bits at a time (with parallel passes).
+    static void radixSort(std::vector<MortonTri>& tris);
+
+    /// A reference to a triangle in a spatial-split BVH. A triangle may be referenced by several
+    ///     nodes, and each reference is only bounded by the part of the triangle within its node.
+    struct SBVHRef
+    {
+        TriInd tri;
+        BoundingBox3f bb;
+    };
+
+    /// Builds a spatial-split BVH over all triangles. Leaves are appended to leafTris.
+    Node* buildSBVH();
+
+    /// Recursively builds the spatial-split BVH over refs, which it deletes.
+    /// \param bb The AABB bounding the references.
+    /// \param rootSA The surface area of the root (for the spatial split threshold).
+    /// \param budget The number of references that splits may still add.
+    Node* buildSBVH(const BoundingBox3f& bb, std::vector<SBVHRef>* refs, int depth,
+                    float rootSA, std::atomic<long long>& budget);
+
     /// Searches through all the triangles in a leaf node for the closest intersection, and
     ///     returns that triangle index. Returns -1 on no intersection
+    /// \tparam shadowRay If this is a shadow ray query (the first hit is returned, and its is
+    ///     never written)
     /// \param n The LEAF node to look through.
     /// \param ray The ray
     /// \param its Intersection
-    /// \param shadowRay If this is a shadow ray query
     /// \return TriInd of triangle in the meshes on intersection, or -1 on none.
-    TriInd leafRayTriIntersect(Node* n, Ray3f& ray_, Intersection &its, bool shadowRay) const;
+    template <bool shadowRay>
+    TriInd leafRayTriIntersect(const LinearNode& n, Ray3f& ray_, Intersection &its) const;
 
-    /// Searches through all the triangles in a node for the closest intersection, and
+    /// Searches through all the triangles in the flattened tree for the closest intersection, and
     ///     returns that triangle index. Returns -1 on no intersection
-    /// \param n The node to look through.
+    /// \tparam shadowRay If this is a shadow ray query: the search ends at the first hit, and
+    ///     children are visited in their occludeFirst order
     /// \param ray The ray
     /// \param its Intersection
-    /// \param shadowRay If this is a shadow ray query
     /// \return TriInd of triangle in the meshes on intersection, or -1 on none.
-    TriInd nodeCloseTriIntersect(Node* n, const Ray3f& ray, Intersection &its, bool shadowRay) const;
+    template <bool shadowRay>
+    TriInd nodeCloseTriIntersect(const Ray3f& ray, Intersection &its) const;
+
+    /// Appends the subtree n to the linear node array (depth-first).
+    /// \param n The subtree to flatten.
+    /// \param depth The depth of n in the tree.
+    /// \return The index of n within nodes.
+    uint32_t flatten(const Node* n, int depth);
+
+    /// Appends a leaf over leafTris[first, first + count) to the linear node array,
+    ///     splitting it into several leaves if it is too large for a LinearNode.
+    /// \return The index of the new node within nodes.
+    uint32_t flattenLeaf(const BoundingBox3f& bb, uint32_t first, uint32_t count, int depth);
+
+    /// Recomputes the bounds of the subtree at nodes[index] from its triangles (bottom-up).
+    /// \param depth The depth of the node (subtrees near the root are refit in parallel).
+    void refitNode(uint32_t index, int depth);
+
+    /// Returns the SAH cost of the subtree at nodes[index], normalized by the root's area.
+    float sahCost(uint32_t index) const;
 
     /// A struct that holds all the needed data from a split
     struct SplitData
     {
-        SplitData(): index((std::size_t)-1), dim(-1), bb1(), bb2(), tris1(nullptr), tris2(nullptr) {};
+        SplitData(): index((std::size_t)-1), dim(-1), bb1(), bb2() {};
         SplitData(std::size_t index, int dim,
-                  BoundingBox3f bb1, BoundingBox3f bb2,
-                  std::vector<TriInd> *tris1, std::vector<TriInd> *tris2):
-            index(index), dim(dim), bb1(bb1), bb2(bb2), tris1(tris1), tris2(tris2) {};
+                  BoundingBox3f bb1, BoundingBox3f bb2):
+            index(index), dim(dim), bb1(bb1), bb2(bb2) {};
 
+        /// The number of triangles in the first child
         std::size_t index;
         int dim;
         BoundingBox3f bb1;
         BoundingBox3f bb2;
-        std::vector<TriInd> *tris1;
-        std::vector<TriInd> *tris2;
     };
 
-    /// Returns an optimal index for the list, tris. Tris is sorted over the z-axis.
+    /// Returns an optimal split for the triangles leafTris[start, end), and reorders
+    ///     that range so the first child's triangles come first.
     /// \param bb The AABB bounding the triangles.
-    /// \param tris The triangles within the AABB. Is sorted over the z-axis.
+    /// \param start The first triangle in leafTris
+    /// \param end One past the last triangle in leafTris
     /// \return All the information needed after a split. See SplitData
-    SplitData getGoodSplit(const BoundingBox3f &bb, std::vector<TriInd> *tris,
-                           SplitMethod method) const;
+    SplitData getGoodSplit(const BoundingBox3f &bb, uint32_t start, uint32_t end,
+                           SplitMethod method);
+
+    /// The number of triangles in, and the bounds of, one SAH bucket
+    struct Bucket
+    {
+        uint32_t count = 0;
+        BoundingBox3f bb;
+    };
+
+    /// The SAH buckets of a node along all three axes
+    struct Bins
+    {
+        void add(int d, int bucket, const BoundingBox3f& triBB)
+        {
+            ++buckets[d][bucket].count;
+            buckets[d][bucket].bb.expandBy(triBB);
+        }
+
+        void merge(const Bins& other);
+
+        Bucket buckets[3][BUCKETS];
+    };
+
+    /// Returns which of two children (with bounds a and b) shadow rays should visit first:
+    ///     the one a ray through their parent is more likely to hit (the larger one).
+    static uint8_t occludeFirst(const BoundingBox3f& a, const BoundingBox3f& b);
+
+    /// Returns the bucket (along dimension d) of a triangle with the given centroid,
+    ///     for a node bounded by bb.
+    static int bucketIndex(const BoundingBox3f& bb, const Point3f& centroid, int d);
+
+    /// Counts and bounds the triangles leafTris[start, end) per bucket (in parallel for big ranges)
+    Bins binTris(const BoundingBox3f& bb, uint32_t start, uint32_t end) const;
 
     BoundingBox3f getTriBB(const TriInd& t) const{
         return meshes[t.mesh]->getBoundingBox(t.i);
     }
 
-    /// Sort a vector of triangle indicies, triind, by their center coordinate over dimension d
-    /// \param tris Triangle index vector. Will be sorted/edited in place.
+    /// Sort a range of triangle indicies, triind, by their center coordinate over dimension d
+    /// \param tris Triangle index range. Will be sorted/edited in place.
+    /// \param n The number of triangles in the range
     /// \param d The dimension (0 = x, 1 = y, ...)
-    void sortOnDim(std::vector<TriInd> *tris, int d) const;
+    void sortOnDim(TriInd *tris, std::size_t n, int d) const;
 
 private:
-    Node* root;
+    /// The flattened tree, in depth-first order (root at index 0).
+    std::vector<LinearNode> nodes;
 
 	SplitMethod m_method;
+    bool m_optimizeTreelets;
+
+    /// The SAH cost of the tree when it was built (see setRebuildRatio())
+    float m_builtCost = 0;
+    float m_rebuildRatio = 0;
 
 };
 
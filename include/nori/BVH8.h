@@ -0,0 +1,101 @@
+//
+// An 8-wide BVH with AVX2 kernels, collapsed from the binary SAH BVH.
+//
+
+#pragma once
+
+#include "nori/QBVH.h"
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief An 8-wide BVH, traversed with AVX2 (8 boxes / 8 triangles per test)
+ *
+ * The kernel is chosen at build time from the CPU that is running: if AVX2 is not
+ * supported, this falls back to a QBVH and its SSE kernel, so one binary runs everywhere.
+ */
+class BVH8: public AccelTree
+{
+public:
+    /// The size of the traversal stack. Up to 7 entries are pushed per level, and a
+    ///     BVH8 is never deeper than the BVH it was collapsed from.
+    static constexpr int STACK_SIZE = 7 * BVH::STACK_SIZE + 1;
+
+public:
+    /// An 8-wide node (256 bytes). The children's bounds are stored as a structure of arrays,
+    ///     so one ray can be tested against all eight boxes at once.
+    /// Leaf children are stored directly in their parent, as a range of TriBlocks.
+    struct Node
+    {
+        /// Creates a node with eight empty child slots (whose boxes can never be hit)
+        Node();
+
+        /// Sets child slot i to the bounds of bb
+        void setBounds(int i, const BoundingBox3f& bb);
+
+        /// The bounds of the eight children: bounds[0][axis] = min, bounds[1][axis] = max
+        float bounds[2][3][8];
+        /// Leaf: index of the first TriBlock. Otherwise: index of the child node.
+        uint32_t child[8];
+        /// The number of TriBlocks in a leaf child (0 for inner/empty children).
+        uint16_t blockCount[8];
+        uint8_t pad[16];
+    };
+
+    /// Eight precomputed triangles (one vertex and two edges each), stored as a structure
+    ///     of arrays so that a ray is tested against all of them at once.
+    /// Unused lanes hold degenerate triangles, which can never be hit.
+    struct TriBlock
+    {
+        float p0[3][8];
+        float edge1[3][8];
+        float edge2[3][8];
+        /// The index of each lane's triangle within leafTris
+        uint32_t ref[8];
+    };
+
+public:
+    BVH8(BVH::SplitMethod method = BVH::SAHBuckets, bool optimizeTreelets = false) :
+        AccelTree(), m_method(method), m_optimizeTreelets(optimizeTreelets) {};
+
+    ~BVH8() override
+    {
+        delete fallback;
+    }
+
+    void build() override;
+
+    TriInd rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const override;
+
+    /// Whether the CPU running this supports the AVX2 kernels (detected once).
+    static bool cpuSupportsAVX2();
+
+private:
+    /// Collapses the binary node bin[n] and its descendants into one 8-wide node (recursively).
+    /// \param bin The flattened binary BVH
+    /// \param n The index of an interior node within bin
+    /// \return The index of the new node within nodes
+    uint32_t collapse(const std::vector<BVH::LinearNode>& bin, uint32_t n);
+
+    /// Packs the triangles of a binary leaf into TriBlocks.
+    /// \return The index of the first new TriBlock
+    uint32_t addBlocks(const BVH::LinearNode& leaf);
+
+    /// The AVX2 traversal (only called if cpuSupportsAVX2())
+    TriInd rayIntersectAVX2(const Ray3f &ray_, Intersection &its, bool shadowRay) const;
+
+private:
+    /// The 8-wide nodes (root at index 0)
+    std::vector<Node> nodes;
+    /// The triangles of all leaves, in blocks of 8
+    std::vector<TriBlock> blocks;
+
+    /// The SSE QBVH used instead, if the CPU does not support AVX2.
+    QBVH* fallback = nullptr;
+
+    BVH::SplitMethod m_method;
+    bool m_optimizeTreelets;
+
+};
+
+NORI_NAMESPACE_END
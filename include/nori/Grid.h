@@ -0,0 +1,97 @@
+//
+// A uniform grid (or a two-level grid, whose dense cells hold grids of their own) traversed
+//     with a 3D-DDA.
+//
+
+#pragma once
+
+#include "nori/AccelTree.h"
+
+NORI_NAMESPACE_BEGIN
+
+class Grid: public AccelTree
+{
+public:
+    /// The number of cells per triangle of a uniform grid (or of a two-level grid's sub-grids).
+    static constexpr float DENSITY = 4.0f;
+    /// The number of cells per triangle of a two-level grid's top level.
+    static constexpr float TOP_DENSITY = 0.25f;
+    /// A cell of a two-level grid's top level with more triangles than this gets a sub-grid.
+    static constexpr uint32_t SUBGRID_TRIS = 16;
+    /// The most cells along each axis of any grid.
+    static constexpr int MAX_RES = 512;
+
+public:
+    /// A cell (8 bytes): the range of its triangles within leafTris, or its sub-grid.
+    struct Cell
+    {
+        /// Set in count for cells with a sub-grid (whose index within grids is first).
+        static constexpr uint32_t SUBGRID = 1u << 31;
+
+        bool isSubGrid() const
+        {
+            return (count & SUBGRID) != 0;
+        }
+
+        uint32_t first, count;
+    };
+
+    /// One grid: its bounds, resolution, and cells (a range within cells, x fastest).
+    struct Level
+    {
+        BoundingBox3f AABB;
+        int res[3];
+        Vector3f cellSize, invCellSize;
+        uint32_t firstCell;
+    };
+
+public:
+    /// \param twoLevel Whether dense cells (see SUBGRID_TRIS) get a grid of their own.
+    ///     Adapts to scenes whose triangles are unevenly spread, at the cost of a second level.
+    Grid(bool twoLevel = false) : AccelTree(), m_twoLevel(twoLevel) {};
+
+    void build() override;
+
+    /// Rebuilds the grid from scratch (which takes linear time) for the moved vertices.
+    void refit() override;
+
+    TriInd rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const override;
+
+private:
+    /// Sets up a grid over bb with about density cells per triangle (cubic cells, as far as
+    ///     the resolution allows).
+    static Level makeLevel(const BoundingBox3f& bb, std::size_t triCount, float density);
+
+    /// Returns the box of cell (x, y, z) of level
+    static BoundingBox3f cellBB(const Level& level, int x, int y, int z);
+
+    /// Fills the cells of a level with tris: every cell's triangles are counted, then scattered
+    ///     into cellTris (both in parallel over the triangles).
+    /// \param cellTris The triangles of all cells (cell k's are [cells[k].first, + cells[k].count))
+    void fillLevel(const Level& level, const std::vector<TriInd>& tris,
+                   std::vector<Cell>& cells, std::vector<TriInd>& cellTris) const;
+
+    /// Returns whether tri overlaps cell, whose box is first tested against the triangle's plane
+    ///     (normal n, n . p = d), then clipped against the triangle.
+    bool triInCell(const TriInd& tri, const Vector3f& n, float d, const BoundingBox3f& cell) const;
+
+    /// Walks the cells of grids[level] along the ray (3D-DDA) from tEnter to tExit, testing
+    ///     their triangles (and walking their sub-grids).
+    /// \param ray The ray, shortened to the closest hit so far
+    /// \param closeTri The closest hit so far
+    /// \return Whether the search is over (a hit that nothing can be closer than was found)
+    bool traverse(uint32_t level, Ray3f& ray, float tEnter, float tExit, Intersection &its,
+                  bool shadowRay, TriInd& closeTri) const;
+
+    /// Clears the grid, and builds it for the current meshes
+    void buildGrid();
+
+private:
+    /// The top-level grid, then any sub-grids
+    std::vector<Level> grids;
+    std::vector<Cell> cells;
+
+    bool m_twoLevel;
+};
+
+NORI_NAMESPACE_END
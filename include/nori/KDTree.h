@@ -21,6 +21,9 @@ public:
     static constexpr float TRI_INT_COST = 2;
     static constexpr float EMPTY_MODIFIER = .8;
 
+    /// SAH nodes with at least this many triangles build their children in parallel.
+    static constexpr std::size_t PARALLEL_TRIS = 4096;
+
 public:
     enum SplitMethod{Midpoint, SAHFull, BruteForce};
 
@@ -46,11 +49,11 @@ public:
     };
 
     /// A node for the KDTree, which contains 2 children, stores its own AABB,
-    ///     and a vector of triangle indices.
+    ///     and the range of its triangles within leafTris (leaves only).
     struct Node
     {
-        Node(BoundingBox3f bb, std::vector<TriInd>* triangles, Split split):
-            AABB(bb), tris(triangles), s(split)
+        Node(BoundingBox3f bb, uint32_t start, uint32_t end, Split split, bool isLeaf):
+            AABB(bb), triStart(start), triEnd(end), s(split), leaf(isLeaf)
         {
             children[0] = nullptr;
             children[1] = nullptr;
@@ -62,13 +65,12 @@ public:
             {
                 delete c;
             }
-            delete tris;
 
         }
 
         bool isLeaf() const
         {
-            return tris != nullptr;
+            return leaf;
         }
 
         uint32_t nodeCount() const
@@ -87,7 +89,7 @@ public:
 
         uint32_t triCount() const
         {
-            if(isLeaf() && tris != nullptr) return tris->size();
+            if(isLeaf()) return triEnd - triStart;
 
             uint32_t count = 0;
             for (auto & i : children)
@@ -103,30 +105,123 @@ public:
 
         Node* children[2];
         BoundingBox3f AABB;
-        //The indices of the triangles in the mesh. If nullptr this is not a leaf node
-        std::vector<TriInd>* tris;
+        /// The triangles of a leaf are leafTris[triStart, triEnd).
+        uint32_t triStart, triEnd;
 
         ///The split location for this KD Node.
         Split s;
+
+        bool leaf;
     };
 
-    /// A simple struct used for SAH triangle sorting and "events" (enter/exit tri)
-    struct TriSAH
+    /// A compact node used for traversal (8 bytes). Nodes are stored in one array, with the two
+    ///     children of an interior node next to each other. Node boxes are not stored: they
+    ///     are derived from the scene's box and the splits while traversing.
+    struct LinearNode
     {
-        TriInd t;
-        Vector3f pt;
-        ///Is this the min point? (or the max point)
-        bool min;
+        /// The value of flags' lowest 2 bits for leaves (otherwise they hold the split axis).
+        static constexpr uint32_t LEAF = 3;
+
+        static LinearNode leaf(uint32_t first, uint32_t count)
+        {
+            LinearNode n;
+            n.first = first;
+            n.flags = (count << 2) | LEAF;
+            return n;
+        }
+
+        static LinearNode interior(int axis, float split, uint32_t children)
+        {
+            LinearNode n;
+            n.split = split;
+            n.flags = (children << 2) | (uint32_t)axis;
+            return n;
+        }
+
+        bool isLeaf() const
+        {
+            return (flags & 3) == LEAF;
+        }
+
+        int axis() const
+        {
+            return (int)(flags & 3);
+        }
+
+        /// Interior: the index of the first (lower) child (the second follows it)
+        uint32_t children() const
+        {
+            return flags >> 2;
+        }
+
+        /// Leaf: the number of triangles (starting at leafTris[first])
+        uint32_t triCount() const
+        {
+            return flags >> 2;
+        }
+
+        union
+        {
+            /// Interior: the (absolute) position of the split plane along its axis
+            float split;
+            /// Leaf: the index of the first triangle within leafTris
+            uint32_t first;
+        };
+        /// Bits 0-1: the split axis (or LEAF). Bits 2-31: children() or triCount().
+        uint32_t flags;
     };
 
-public:
-    KDTree(SplitMethod method = SAHFull):
-		AccelTree(), m_method(method), root(nullptr) {};
+    /// A rope to nowhere (the face of the leaf is on the scene's boundary).
+    static constexpr uint32_t NO_ROPE = (uint32_t)-1;
 
-    ~KDTree() override
+    /// The extra data of a leaf in the rope layout (see setRopes()).
+    struct RopeLeaf
     {
-        delete root;
-    }
+        /// The leaf's box (needed to find where a ray leaves it)
+        BoundingBox3f AABB;
+        /// The triangles of the leaf are leafTris[first, first + count)
+        uint32_t first, count;
+        /// For each face (2 * axis + (0 for the min face, 1 for the max face)), the smallest node
+        ///     that holds all the leaves behind it (or NO_ROPE)
+        uint32_t ropes[6];
+    };
+
+    /// Where the bounds of a triangle start or end along an axis (or both, for triangles that
+    ///     are planar along it). Used by the SAH build (Wald & Havran), which sorts the events
+    ///     once and then splits the sorted lists between the children at every node.
+    struct Event
+    {
+        enum Type : uint8_t {End = 0, Planar = 1, Start = 2};
+
+        /// Sorted by position, with ends before planar events before starts
+        bool operator<(const Event& e) const
+        {
+            return pos < e.pos || (pos == e.pos && type < e.type);
+        }
+
+        float pos;
+        /// The index of the triangle within its node's EventList::tris
+        uint32_t tri;
+        Type type;
+    };
+
+    /// The triangles of a node (in a SAH build), and their events along each axis
+    struct EventList
+    {
+        std::vector<TriInd> tris;
+        /// The events along each axis, sorted
+        std::vector<Event> events[3];
+
+        /// Appends the events (along every axis) of tris[tri], bounded by bb
+        void addEvents(uint32_t tri, const BoundingBox3f& bb);
+    };
+
+public:
+    /// \param perfectSplits Whether triangles are clipped to the node boxes (instead of using
+    ///     their whole AABBs), both for the SAH and for deciding which children they belong to.
+    ///     Fewer triangles are duplicated, at the cost of a slower build.
+    KDTree(SplitMethod method = SAHFull, bool perfectSplits = false):
+		AccelTree(), m_method(method), m_perfectSplits(perfectSplits) {};
 
     void build() override
     {
@@ -137,6 +232,12 @@ public:
 
     TriInd rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const override;
 
+    /// Whether to link every leaf to its neighbours across each of its faces ("ropes"), and
+    ///     trace rays from leaf to leaf along them instead of with a stack. Costs 56 bytes
+    ///     per leaf (a RopeLeaf), plus 4 bytes per node (its index into the rope leaves).
+    ///     Must be set before \ref build() is called.
+    void setRopes(bool ropes) { if (!built) m_ropes = ropes; }
+
 
     /// Takes a bounding box, and returns the lower bounding box in the KD Split
     /// \param bb The original AABB
@@ -155,25 +256,58 @@ private:
     Node* build(const BoundingBox3f& bb, std::vector<TriInd>* tris, int depth,
                 SplitMethod method);
 
+    /// Recursively builds the SAH subtree over the triangles of list (which it deletes).
+    Node* buildSAH(const BoundingBox3f& bb, EventList* list, int depth);
+
+    /// Finds the split with the lowest SAH cost by sweeping over the events along each axis.
+    /// \param planarLeft Set to whether triangles lying in the split plane go to the lower child.
+    /// \return The split, or an invalid split if no split is cheaper than a leaf.
+    Split getSAHSplit(const BoundingBox3f& bb, const EventList& list, bool& planarLeft) const;
+
+    /// Creates a leaf node, moving tris into leafTris (tris is deleted).
+    Node* makeLeaf(const BoundingBox3f& bb, std::vector<TriInd>* tris, Split s);
+
+    /// Writes the subtree n (which may be nullptr, for an empty leaf) to nodes[index],
+    ///     appending the children of interior nodes to nodes as adjacent pairs.
+    void flatten(const Node* n, uint32_t index);
+
+    /// Adds the rope layout of the subtree at nodes[index] (bounded by bb), whose faces
+    ///     lead to the given ropes.
+    void buildRopes(uint32_t index, const BoundingBox3f& bb, const uint32_t (&ropes)[6]);
+
+    /// Moves a rope from face f of the box bb down the tree, as long as a single child of the
+    ///     node it points to holds everything behind the face.
+    uint32_t optimizeRope(uint32_t rope, int f, const BoundingBox3f& bb) const;
+
+    /// Traces a ray from leaf to leaf along the ropes (instead of with a stack).
+    template <bool shadowRay>
+    TriInd ropeCloseTriIntersect(const Ray3f& ray_, Intersection &its) const;
+
     /// Searches through all the triangles in a leaf node for the closest intersection, and
     ///     returns that triangle index. Returns -1 on no intersection
     /// \param n The LEAF node to look through.
     /// \param ray The ray
     /// \param its Intersection
-    /// \param shadowRay If this is a shadow ray query
+    /// \tparam shadowRay If this is a shadow ray query (the first hit is returned, and its is
+    ///     never written)
     /// \return TriInd of triangle in the meshes on intersection, or -1 on none.
-    TriInd leafRayTriIntersect(Node* n, const Ray3f& ray_, Intersection &its, bool shadowRay) const;
+    template <bool shadowRay>
+    TriInd leafRayTriIntersect(const LinearNode& n, const Ray3f& ray_, Intersection &its) const;
 
-    /// Searches through all the triangles in a node for the closest intersection, and
+    /// Searches through all the triangles in the flattened tree for the closest intersection, and
     ///     returns that triangle index. Returns -1 on no intersection
-    /// \param n The node to look through.
+    /// Nodes are visited front to back by the ray's (tmin, tmax) interval within them, split at
+    ///     the split planes, and a leaf's hit is only final if it lies within that leaf's interval.
     /// \param ray The ray
     /// \param its Intersection
-    /// \param shadowRay If this is a shadow ray query
+    /// \tparam shadowRay If this is a shadow ray query (the first hit is returned, and its is
+    ///     never written)
     /// \return TriInd of triangle in the meshes on intersection, or -1 on none.
-    TriInd nodeCloseTriIntersect(Node* n, const Ray3f& ray_, Intersection &its, bool shadowRay) const;
+    template <bool shadowRay>
+    TriInd nodeCloseTriIntersect(const Ray3f& ray_, Intersection &its) const;
 
-    /// Returns an optimal split for the current AABB and the tris within said AABB.
+    /// Returns a split for the current AABB and the tris within said AABB (Midpoint/BruteForce;
+    ///     SAH builds use getSAHSplit()).
     /// \param bb The AABB bounding the triangles.
     /// \param tris The triangles within the AABB
     /// \return A split representing where to split the current node.
@@ -184,10 +318,21 @@ private:
         return meshes[t.mesh]->getBoundingBox(t.i);
     }
 
+    /// Returns the bounds of the part of a triangle within bb (an invalid box if it misses bb).
+    ///     Exact with perfect splits, otherwise the triangle's AABB clipped to bb.
+    BoundingBox3f getTriBB(const TriInd& t, const BoundingBox3f& bb) const;
+
 private:
-    Node* root;
+    /// The flattened tree (root at index 0).
+    std::vector<LinearNode> nodes;
+
+    /// The rope layout (if enabled): the leaves, and the index of each leaf node within them.
+    std::vector<RopeLeaf> ropeLeaves;
+    std::vector<uint32_t> ropeLeafInd;
+    bool m_ropes = false;
 
 	SplitMethod m_method;
+    bool m_perfectSplits;
 
 };
 
@@ -14,20 +14,24 @@ public:
     ///The upper bound for triangles in a node that stops the node from subdividing.
     static constexpr std::size_t FEW_TRIS = 10;
     static constexpr int MAX_DEPTH = 12;
+    /// How much larger the box of a loose octree's node is than its (tight) cell.
+    static constexpr float LOOSENESS = 1.5f;
 
 public:
     /// A node for the Octree, which contains 8 children, stores its own AABB,
-    ///     and a vector of triangle indices.
+    ///     and the range of its triangles within leafTris (leaves, and any node of a loose octree).
     struct Node
     {
-        Node(BoundingBox3f bb, std::vector<TriInd>* triangles)
+        Node(BoundingBox3f bb, uint32_t start, uint32_t end, bool isLeaf)
         {
             for (int i = 0; i < 8; ++i)
             {
                 children[i] = nullptr;
             }
             AABB = bb;
-            tris = triangles;
+            triStart = start;
+            triEnd = end;
+            leaf = isLeaf;
         }
 
         ~Node()
@@ -36,13 +40,12 @@ public:
             {
                 delete c;
             }
-            delete tris;
 
         }
 
         bool isLeaf() const
         {
-            return tris != nullptr;
+            return leaf;
         }
 
         uint32_t nodeCount() const
@@ -61,7 +64,7 @@ public:
 
         uint32_t triCount() const
         {
-            if(isLeaf() && tris != nullptr) return tris->size();
+            if(isLeaf()) return triEnd - triStart;
 
             uint32_t count = 0;
             for (auto & i : children)
@@ -77,30 +80,79 @@ public:
 
         Node* children[8];
         BoundingBox3f AABB;
-        //The indices of the triangles in the mesh. If nullptr this is not a leaf node
-        std::vector<TriInd>* tris;
+        /// The triangles of a leaf are leafTris[triStart, triEnd).
+        uint32_t triStart, triEnd;
+
+        bool leaf;
     };
 
-    /// A simple struct for holding a float and a Node, used for sorting.
-    struct NodeComp
+    /// A compact node used for traversal (8 bytes), in the form of a sparse voxel octree. Only
+    ///     non-empty children are stored, next to each other in child order, and whether each
+    ///     of them is a leaf is stored in its parent. Node boxes are not stored (see childBB()).
+    struct LinearNode
     {
-        NodeComp(): dist(0), n(nullptr) {};
-        NodeComp(float d, Node* n): dist(d), n(n) {};
+        static LinearNode leaf(uint32_t first, uint32_t count)
+        {
+            LinearNode n;
+            n.offset = first;
+            n.bits = count;
+            return n;
+        }
+
+        static LinearNode interior(uint32_t children, uint8_t childMask, uint8_t leafMask)
+        {
+            LinearNode n;
+            n.offset = children;
+            n.bits = childMask | ((uint32_t)leafMask << 8);
+            return n;
+        }
+
+        /// Interior: whether child c (see childBB()) holds any triangles
+        bool hasChild(int c) const
+        {
+            return (bits >> c) & 1;
+        }
+
+        /// Interior: whether child c is a leaf
+        bool childIsLeaf(int c) const
+        {
+            return (bits >> (8 + c)) & 1;
+        }
+
+        /// Interior: the index of child c (which must exist) within nodes
+        uint32_t child(int c) const
+        {
+            //The children before it are the ones in the mask below bit c
+            uint32_t before = bits & ((1u << c) - 1);
+            before = before - ((before >> 1) & 0x55);
+            before = (before & 0x33) + ((before >> 2) & 0x33);
+            return offset + ((before + (before >> 4)) & 0x0F);
+        }
 
-        bool operator<(const NodeComp& right) const
+        /// Leaf: the number of triangles (starting at leafTris[offset])
+        uint32_t triCount() const
         {
-            return dist < right.dist;
+            return bits;
         }
 
-        float dist;
-        Node* n;
+        /// Interior: the index of the first stored child. Leaf: the index of the first triangle
+        ///     within leafTris.
+        uint32_t offset;
+        /// Interior: bits 0-7 are the child mask, and bits 8-15 the leaf mask. Leaf: triCount().
+        uint32_t bits;
     };
 
-public:
-    ~Octree() override
+    /// The triangles of a loose octree's interior node (a range within leafTris).
+    struct TriRange
     {
-        delete root;
-    }
+        uint32_t first, count;
+    };
+
+public:
+    /// \param loose Whether to build a loose octree: every node's box is LOOSENESS times as
+    ///     large as its cell, and every triangle is stored once, in the deepest node whose
+    ///     (loose) box contains it. Interior nodes then hold triangles too.
+    Octree(bool loose = false) : AccelTree(), m_loose(loose) {};
 
     void build() override;
 
@@ -115,26 +167,72 @@ public:
 private:
     Node* build(const BoundingBox3f& bb, std::vector<TriInd>* tris, int depth);
 
+    /// Builds a loose octree node over tris (which it deletes) for the cell bb. Each triangle is
+    ///     passed down to the child cell its center is in, if it fits in that child's loose box.
+    Node* buildLoose(const BoundingBox3f& bb, std::vector<TriInd>* tris, int depth);
+
+    /// Returns the loose box of the node whose cell is bb
+    static BoundingBox3f looseBB(const BoundingBox3f& bb);
+
+    /// Creates a leaf node, moving tris into leafTris (tris is deleted).
+    Node* makeLeaf(const BoundingBox3f& bb, std::vector<TriInd>* tris);
+
+    /// Stores the children of the interior node n (recursively) at the end of nodes, and n
+    ///     itself at nodes[index].
+    void flatten(const Node* n, uint32_t index);
+
     /// Searches through all the triangles in a leaf node for the closest intersection, and
     ///     returns that triangle index. Returns -1 on no intersection
     /// \param n The LEAF node to look through.
     /// \param ray The ray
     /// \param its Intersection
-    /// \param shadowRay If this is a shadow ray query
+    /// \tparam shadowRay If this is a shadow ray query (the first hit is returned, and its is
+    ///     never written)
     /// \return TriInd of triangle in the meshes on intersection, or -1 on none.
-    TriInd leafRayTriIntersect(Node* n, const Ray3f& ray_, Intersection &its, bool shadowRay) const;
+    template <bool shadowRay>
+    TriInd leafRayTriIntersect(const LinearNode& n, const Ray3f& ray_, Intersection &its) const;
 
-    /// Searches through all the triangles in a node for the closest intersection, and
+    /// Searches through all the triangles in the flattened tree for the closest intersection, and
     ///     returns that triangle index. Returns -1 on no intersection
-    /// \param n The node to look through.
+    /// The children of a node are visited in the order the ray crosses them, which is found from
+    ///     the ray's parameters (t) at the node's slabs and midplanes only (Revelles et al.), so
+    ///     no child boxes are tested and nothing is sorted.
     /// \param ray The ray
     /// \param its Intersection
-    /// \param shadowRay If this is a shadow ray query
+    /// \tparam shadowRay If this is a shadow ray query (the first hit is returned, and its is
+    ///     never written)
     /// \return TriInd of triangle in the meshes on intersection, or -1 on none.
-    TriInd nodeCloseTriIntersect(Node* n, const Ray3f& ray_, Intersection &its, bool shadowRay) const;
+    template <bool shadowRay>
+    TriInd nodeCloseTriIntersect(const Ray3f& ray_, Intersection &its) const;
+
+    /// Returns the first child (in a node whose ray parameters are t0 at its min corner and tm at
+    ///     its center) that a ray with a positive direction enters.
+    static int firstChild(const Vector3f& t0, const Vector3f& tm);
+
+    /// Returns the child a ray with a positive direction enters after leaving child c through its
+    ///     nearest exit plane (t1 being the ray parameters at c's max corner), or 8 if it leaves the
+    ///     parent instead.
+    static int nextChild(int c, const Vector3f& t1);
+
+    /// Searches a loose octree for the closest intersection. Loose boxes overlap, so every
+    ///     node's box is tested, and the search only ends once every node the ray reaches
+    ///     before its closest hit has been searched.
+    template <bool shadowRay>
+    TriInd looseCloseTriIntersect(const Ray3f& ray_, Intersection &its) const;
+
+    /// Tests the triangles leafTris[first, first + count), shortening ray to the closest hit.
+    template <bool shadowRay>
+    TriInd rangeRayTriIntersect(uint32_t first, uint32_t count, Ray3f& ray, Intersection &its) const;
 
 private:
-    Node* root;
+    /// The flattened tree (root at index 0, if there are any triangles).
+    std::vector<LinearNode> nodes;
+    /// Whether the root itself is a leaf (the scene has few triangles)
+    bool rootLeaf = false;
+
+    /// Loose octrees only: the triangles of each node (parallel to nodes, empty for leaves)
+    std::vector<TriRange> nodeTris;
+    bool m_loose;
 
 };
 
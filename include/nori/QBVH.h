@@ -0,0 +1,82 @@
+//
+// A 4-wide BVH, collapsed from the binary SAH BVH.
+//
+
+#pragma once
+
+#include "nori/BVH.h"
+
+NORI_NAMESPACE_BEGIN
+
+class QBVH: public AccelTree
+{
+public:
+    /// The size of the traversal stack. Up to 3 entries are pushed per level, and a
+    ///     QBVH has half as many levels as the BVH it was collapsed from.
+    static constexpr int STACK_SIZE = 3 * BVH::STACK_SIZE / 2 + 1;
+
+public:
+    /// A 4-wide node (128 bytes). The children's bounds are stored as a structure of arrays,
+    ///     so one ray can be tested against all four boxes at once.
+    /// Leaf children are stored directly in their parent, as a range within leafTris.
+    struct alignas(16) Node
+    {
+        /// Creates a node with four empty child slots (whose boxes can never be hit)
+        Node();
+
+        /// Sets child slot i to the bounds of bb
+        void setBounds(int i, const BoundingBox3f& bb);
+
+        /// Is child slot i a leaf? (Empty slots are neither leaves nor nodes.)
+        bool isLeaf(int i) const
+        {
+            return triCount[i] > 0;
+        }
+
+        /// The bounds of the four children: bounds[0][axis] = min, bounds[1][axis] = max
+        float bounds[2][3][4];
+        /// Leaf: index of the first triangle in leafTris. Otherwise: index of the child node.
+        uint32_t child[4];
+        /// The number of triangles in a leaf child (0 for inner/empty children).
+        uint16_t triCount[4];
+        /// Split axes of the collapsed binary nodes: the parent split (children {0,1} vs {2,3}),
+        ///     then the split between children 0 and 1, and between children 2 and 3.
+        uint8_t axes[3];
+        uint8_t pad[5];
+    };
+
+public:
+    QBVH(BVH::SplitMethod method = BVH::SAHBuckets, bool optimizeTreelets = false) :
+        AccelTree(), m_method(method), m_optimizeTreelets(optimizeTreelets) {};
+
+    void build() override;
+
+    TriInd rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const override;
+
+private:
+    /// Collapses the binary node bin[n] and its children into one 4-wide node (recursively).
+    /// \param bin The flattened binary BVH
+    /// \param n The index of an interior node within bin
+    /// \return The index of the new node within nodes
+    uint32_t collapse(const std::vector<BVH::LinearNode>& bin, uint32_t n);
+
+    /// Searches through all the triangles in a leaf for the closest intersection, and
+    ///     returns that triangle index. Returns -1 on no intersection
+    /// \param start The first triangle of the leaf within leafTris
+    /// \param count The number of triangles in the leaf
+    /// \param ray The ray (maxt is updated on intersection)
+    /// \param its Intersection
+    /// \param shadowRay If this is a shadow ray query
+    /// \return TriInd of triangle in the meshes on intersection, or -1 on none.
+    TriInd leafRayTriIntersect(uint32_t start, uint32_t count, Ray3f& ray, Intersection &its, bool shadowRay) const;
+
+private:
+    /// The 4-wide nodes (root at index 0)
+    std::vector<Node> nodes;
+
+    BVH::SplitMethod m_method;
+    bool m_optimizeTreelets;
+
+};
+
+NORI_NAMESPACE_END
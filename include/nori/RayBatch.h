@@ -0,0 +1,48 @@
+//
+// A (non-owning) span of rays in SoA form, for tracing large numbers of rays in one call.
+//
+
+#pragma once
+
+#include <nori/ray.h>
+
+NORI_NAMESPACE_BEGIN
+
+struct RayBatch
+{
+    RayBatch() = default;
+
+    /// \param ox, oy, oz The components of the ray origins
+    /// \param dx, dy, dz The components of the ray directions
+    /// \param mint, maxt The ray segments (either may be nullptr, for the Ray3f defaults)
+    /// \param size The number of rays
+    RayBatch(const float *ox, const float *oy, const float *oz,
+             const float *dx, const float *dy, const float *dz,
+             const float *mint, const float *maxt, std::size_t size):
+        o{ox, oy, oz}, d{dx, dy, dz}, mint(mint), maxt(maxt), size(size) {};
+
+    /// Returns ray k of the batch
+    Ray3f ray(std::size_t k) const
+    {
+        return Ray3f(Point3f(o[0][k], o[1][k], o[2][k]), Vector3f(d[0][k], d[1][k], d[2][k]),
+                     mint ? mint[k] : Epsilon,
+                     maxt ? maxt[k] : std::numeric_limits<float>::infinity());
+    }
+
+    /// Returns the rays [begin, end) of this batch, as a batch of their own
+    RayBatch slice(std::size_t begin, std::size_t end) const
+    {
+        return RayBatch(o[0] + begin, o[1] + begin, o[2] + begin,
+                        d[0] + begin, d[1] + begin, d[2] + begin,
+                        mint ? mint + begin : nullptr, maxt ? maxt + begin : nullptr,
+                        end - begin);
+    }
+
+    const float *o[3] = {nullptr, nullptr, nullptr};
+    const float *d[3] = {nullptr, nullptr, nullptr};
+    const float *mint = nullptr;
+    const float *maxt = nullptr;
+    std::size_t size = 0;
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,34 @@
+//
+// A small bundle of (coherent) rays that are traced through an AccelTree together.
+//
+
+#pragma once
+
+#include <nori/ray.h>
+
+NORI_NAMESPACE_BEGIN
+
+struct RayPacket
+{
+    /// The most rays a packet can hold (a multiple of 4, for the SSE box tests).
+    static constexpr int MAX_SIZE = 16;
+
+    /// Appends a ray to the packet. Returns false if the packet is already full.
+    bool add(const Ray3f &ray)
+    {
+        if (size >= MAX_SIZE) return false;
+        rays[size++] = ray;
+        return true;
+    }
+
+    bool full() const
+    {
+        return size == MAX_SIZE;
+    }
+
+    /// The number of rays in the packet (rays[0, size) are valid).
+    int size = 0;
+    Ray3f rays[MAX_SIZE];
+};
+
+NORI_NAMESPACE_END
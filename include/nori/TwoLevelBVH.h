@@ -0,0 +1,79 @@
+//
+// A two-level BVH: one (bottom-level) BVH per unique mesh, and a top-level BVH over the
+//     instances of those meshes, each placed in the scene by its own transform.
+//
+
+#pragma once
+
+#include "nori/BVH.h"
+
+NORI_NAMESPACE_BEGIN
+
+class TwoLevelBVH: public AccelTree
+{
+public:
+    /// The most instances in a leaf of the top-level BVH.
+    static constexpr uint32_t LEAF_INSTANCES = 2;
+    /// The size of the top-level traversal stack (the top-level tree is balanced).
+    static constexpr int STACK_SIZE = 64;
+
+public:
+    /// One placement of a bottom-level BVH in the scene
+    struct Instance
+    {
+        /// The index of the instanced mesh's BVH within blases
+        uint32_t blas;
+        /// Object-to-world, and its inverse (which rays are brought into the BVH's space with)
+        Transform toWorld, toLocal;
+        /// The bounds of the instance in world space
+        BoundingBox3f bb;
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+public:
+    /// \param method The split method of the bottom-level BVHs
+    TwoLevelBVH(BVH::SplitMethod method = BVH::SAHBuckets) :
+        AccelTree(), m_method(method) {};
+
+    ~TwoLevelBVH() override;
+
+    /// Registers an instance of mesh. (Meshes added with addMesh() are placed once, as they are.)
+    void addInstance(Mesh *mesh, const Transform &toWorld) override;
+
+    void build() override;
+
+    /// Refits the bottom-level BVHs (see BVH::refit()), then the top-level BVH over them.
+    void refit() override;
+
+    /// The returned TriInd's mesh is the index of the instance that was hit.
+    TriInd rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const override;
+
+    const Transform *getInstanceTransform(const TriInd &tri) const override
+    {
+        return &instances[tri.mesh].toWorld;
+    }
+
+private:
+    /// Returns the world-space bounds of the mesh of blases[blas] placed by toWorld
+    BoundingBox3f instanceBB(uint32_t blas, const Transform &toWorld) const;
+
+    /// Builds the top-level subtree over instances[start, end) (reordering that range),
+    ///     appending it to nodes (depth-first, see BVH::LinearNode).
+    /// \return The index of the subtree's root within nodes
+    uint32_t buildTop(uint32_t start, uint32_t end);
+
+    /// The meshes that were instanced (or added), and their BVHs (one per unique mesh)
+    std::vector<Mesh*> blasMeshes;
+    std::vector<BVH*> blases;
+
+    std::vector<Instance, Eigen::aligned_allocator<Instance>> instances;
+
+    /// The flattened top-level BVH over the instances (leaves index into instances)
+    std::vector<BVH::LinearNode> nodes;
+
+    BVH::SplitMethod m_method;
+
+};
+
+NORI_NAMESPACE_END
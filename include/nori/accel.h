@@ -33,6 +33,14 @@ public:
     /// Build the acceleration data structure (currently a no-op)
     void build();
 
+    /**
+     * \brief Update the acceleration data structure after the vertices of its
+     * meshes moved (see \ref Mesh::setVertexPositions()), without rebuilding it
+     *
+     * This function can only be used after \ref build() is called
+     */
+    void refit();
+
     /// Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const { return m_tree->getBoundingBox(); }
 
@@ -57,7 +65,48 @@ public:
      */
     bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const;
 
+    /**
+     * \brief Intersect a packet of (coherent) rays against all triangles stored in
+     * the scene, sharing a single traversal of the data structure where possible
+     *
+     * \param packet
+     *    The rays to trace
+     *
+     * \param its
+     *    An array of packet.size intersection records, one per ray
+     *
+     * \param hit
+     *    An array of packet.size flags, set to whether each ray found an intersection
+     *
+     * \param shadowRay
+     *    \c true if these are shadow ray queries
+     */
+    void rayIntersectPacket(const RayPacket &packet, Intersection *its, bool *hit, bool shadowRay) const;
+
+    /**
+     * \brief Intersect a (possibly large) batch of rays against all triangles stored
+     * in the scene. The batch is split into blocks that are traced in parallel.
+     *
+     * \param rays
+     *    The rays to trace, in SoA form
+     *
+     * \param its
+     *    An array of rays.size intersection records, one per ray.
+     *    May be nullptr for shadow ray queries.
+     *
+     * \param hit
+     *    An array of rays.size flags, set to whether each ray found an intersection
+     *
+     * \param shadowRay
+     *    \c true if these are shadow ray queries
+     */
+    void rayIntersectBatch(const RayBatch &rays, Intersection *its, bool *hit, bool shadowRay) const;
+
 private:
+    /// Computes the detailed intersection information (position, frames, etc..)
+    ///     of a hit on triangle tri (of its.mesh), given its barycentric coordinates in its.uv
+    void fillIntersection(const AccelTree::TriInd &tri, Intersection &its) const;
+
     AccelTree    *m_tree = nullptr;
 
 };
@@ -123,10 +123,12 @@ class BlockGenerator;
 class Camera;
 class ImageBlock;
 class Integrator;
+struct Intersection;
 class KDTree;
 class Emitter;
 struct EmitterQueryRecord;
 class Mesh;
+class MeshInstance;
 class NoriObject;
 class NoriObjectFactory;
 class NoriScreen;
@@ -0,0 +1,42 @@
+//
+// One placement of a mesh in the scene, so a mesh can be instanced many times without copying it.
+//
+
+#pragma once
+
+#include <nori/object.h>
+#include <nori/transform.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief An instance of a mesh (added as a child of the mesh in the scene file)
+ *
+ * A mesh with instances is placed once per instance, using the instance's
+ * "toWorld" transform (applied on top of the mesh's own transform), instead
+ * of once as it is. Instancing needs an acceleration structure that supports
+ * it, such as \ref TwoLevelBVH.
+ */
+class MeshInstance : public NoriObject {
+public:
+    MeshInstance(const PropertyList &propList) {
+        m_toWorld = propList.getTransform("toWorld", Transform());
+    }
+
+    /// Return the transform that places the mesh in the scene
+    const Transform &getToWorld() const { return m_toWorld; }
+
+    /// Return a human-readable summary
+    std::string toString() const {
+        return tfm::format(
+            "MeshInstance[\n"
+            "  toWorld = %s\n"
+            "]", indent(m_toWorld.toString()));
+    }
+
+    EClassType getClassType() const { return EInstance; }
+private:
+    Transform m_toWorld;
+};
+
+NORI_NAMESPACE_END
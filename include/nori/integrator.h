@@ -53,6 +53,34 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Whether this integrator implements \ref LiPrimary(), so that
+     * camera rays can be traced in packets before it is called
+     */
+    virtual bool supportsPrimaryPackets() const { return false; }
+
+    /**
+     * \brief Sample the incident radiance along a camera ray whose first
+     * intersection has already been found (e.g. as part of a ray packet)
+     *
+     * \param scene
+     *    A pointer to the underlying scene
+     * \param sampler
+     *    A pointer to a sample generator
+     * \param ray
+     *    The ray in question
+     * \param its
+     *    The first intersection along the ray (only valid if \c hit is set)
+     * \param hit
+     *    Whether the ray intersected anything
+     * \return
+     *    A (usually) unbiased estimate of the radiance in this direction
+     */
+    virtual Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                              const Intersection &its, bool hit) const {
+        return Li(scene, sampler, ray);
+    }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
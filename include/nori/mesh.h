@@ -127,6 +127,19 @@ public:
     /// Return a pointer to the vertex positions
     const MatrixXf &getVertexPositions() const { return m_V; }
 
+    /**
+     * \brief Replace the vertex positions (e.g. with the next frame of an animation)
+     *
+     * The triangles stay the same, so acceleration structures over the mesh can be
+     * refit instead of rebuilt (see \ref Accel::refit()).
+     *
+     * \param V
+     *    The new positions, one column per vertex (the vertex count may not change)
+     * \param N
+     *    The new vertex normals (optional; the old ones are kept if empty)
+     */
+    void setVertexPositions(const MatrixXf &V, const MatrixXf &N = MatrixXf());
+
     /// Return a pointer to the vertex normals (or \c nullptr if there are none)
     const MatrixXf &getVertexNormals() const { return m_N; }
 
@@ -145,6 +158,9 @@ public:
     /// Return a pointer to an attached area emitter instance (const version)
     const Emitter *getEmitter() const { return m_emitter; }
 
+    /// Return the instances of this mesh (empty if it is placed once, as it is)
+    const std::vector<MeshInstance *> &getInstances() const { return m_instances; }
+
     /// Return a pointer to the BSDF associated with this mesh
     const BSDF *getBSDF() const { return m_bsdf; }
 
@@ -176,6 +192,7 @@ protected:
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
+    std::vector<MeshInstance *> m_instances; ///< Instances of the mesh, if any
 };
 
 NORI_NAMESPACE_END
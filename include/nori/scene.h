@@ -40,6 +40,12 @@ public:
     /// Return a pointer to the scene's kd-tree
     const Accel *getAccel() const { return m_accel; }
 
+    /**
+     * \brief Update the scene's acceleration data structure after the
+     * vertices of its meshes moved (e.g. for the next frame of an animation)
+     */
+    void refit() { m_accel->refit(); }
+
     /// Return a pointer to the scene's integrator
     const Integrator *getIntegrator() const { return m_integrator; }
 
@@ -96,6 +102,54 @@ public:
         return m_accel->rayIntersect(ray, its, true);
     }
 
+    /**
+     * \brief Intersect a packet of (coherent) rays, such as the camera rays
+     * of a small pixel tile, against all triangles stored in the scene
+     *
+     * \param packet
+     *    The rays to trace
+     *
+     * \param its
+     *    An array of packet.size intersection records, one per ray
+     *
+     * \param hit
+     *    An array of packet.size flags, set to whether each ray found an intersection
+     */
+    void rayIntersectPacket(const RayPacket &packet, Intersection *its, bool *hit) const {
+        m_accel->rayIntersectPacket(packet, its, hit, false);
+    }
+
+    /**
+     * \brief Intersect a (possibly large) batch of rays against all triangles
+     * stored in the scene and return detailed intersection information
+     *
+     * \param rays
+     *    The rays to trace, as arrays of their components (see \ref RayBatch)
+     *
+     * \param its
+     *    An array of rays.size intersection records, one per ray
+     *
+     * \param hit
+     *    An array of rays.size flags, set to whether each ray found an intersection
+     */
+    void rayIntersectBatch(const RayBatch &rays, Intersection *its, bool *hit) const {
+        m_accel->rayIntersectBatch(rays, its, hit, false);
+    }
+
+    /**
+     * \brief Intersect a (possibly large) batch of rays against all triangles
+     * stored in the scene and \a only determine whether or not each ray is occluded
+     *
+     * \param rays
+     *    The rays to trace, as arrays of their components (see \ref RayBatch)
+     *
+     * \param occluded
+     *    An array of rays.size flags, set to whether each ray found an intersection
+     */
+    void rayIntersectBatch(const RayBatch &rays, bool *occluded) const {
+        m_accel->rayIntersectBatch(rays, nullptr, occluded, true);
+    }
+
     /// \brief Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const {
         return m_accel->getBoundingBox();
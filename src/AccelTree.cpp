@@ -4,6 +4,8 @@
 
 #include <nori/AccelTree.h>
 
+#include <tbb/parallel_for.h>
+
 
 NORI_NAMESPACE_BEGIN
 
@@ -24,8 +26,124 @@ void AccelTree::addMesh(Mesh *mesh)
 }
 
 
+void AccelTree::addInstance(Mesh *mesh, const Transform &toWorld)
+{
+    throw NoriException("AccelTree::addInstance(): this acceleration structure does not support "
+                        "instancing (use a TwoLevelBVH)!");
+}
+
+void AccelTree::refit()
+{
+    throw NoriException("AccelTree::refit(): this acceleration structure does not support refitting!");
+}
+
+void AccelTree::refitMeshes()
+{
+    bbox.reset();
+    for (auto mesh: meshes)
+    {
+        bbox.expandBy(mesh->getBoundingBox());
+    }
+
+    tbb::parallel_for(std::size_t(0), triAccels.size(),
+                      [this](std::size_t i)
+                      {
+                          triAccels[i] = TriAccel(meshes[leafTris[i].mesh], leafTris[i].i);
+                      });
+}
+
+void AccelTree::rayIntersectPacket(const RayPacket &packet, Intersection *its, TriInd *tris,
+                                   bool shadowRay) const
+{
+    for (int k = 0; k < packet.size; ++k)
+    {
+        tris[k] = rayIntersect(packet.rays[k], its[k], shadowRay);
+    }
+}
+
+void AccelTree::rayIntersectBatch(const RayBatch &rays, Intersection *its, TriInd *tris,
+                                  bool shadowRay) const
+{
+    Intersection unused; /* Shadow ray queries don't need a record per ray */
+    for (std::size_t k = 0; k < rays.size; ++k)
+    {
+        tris[k] = rayIntersect(rays.ray(k), its ? its[k] : unused, shadowRay);
+    }
+}
+
 bool AccelTree::triIntersects(const BoundingBox3f& bb, const TriInd& tri)
 {
-    return bb.overlaps(meshes[tri.mesh]->getBoundingBox(tri.i), true);
+    return bb.overlaps(meshes[tri.mesh]->getBoundingBox(tri.i));
+}
+
+BoundingBox3f AccelTree::clippedTriBB(const TriInd &tri, const BoundingBox3f &box) const
+{
+    const MatrixXf &V = meshes[tri.mesh]->getVertexPositions();
+    const MatrixXu &F = meshes[tri.mesh]->getIndices();
+
+    //Sutherland-Hodgman: each of the 6 planes adds at most one vertex to the polygon
+    Point3f poly[9], clipped[9];
+    int n = 3;
+    for (int k = 0; k < 3; ++k)
+    {
+        poly[k] = V.col(F(k, tri.i));
+    }
+
+    for (int a = 0; a < 3 && n > 0; ++a)
+    {
+        for (int side = 0; side < 2 && n > 0; ++side)
+        {
+            float plane = side == 0 ? box.min[a] : box.max[a];
+            int m = 0;
+            for (int k = 0; k < n; ++k)
+            {
+                const Point3f &p = poly[k], &q = poly[(k + 1) % n];
+                bool pIn = side == 0 ? p[a] >= plane : p[a] <= plane;
+                bool qIn = side == 0 ? q[a] >= plane : q[a] <= plane;
+                if (pIn)
+                    clipped[m++] = p;
+                if (pIn != qIn)
+                { //The edge crosses the plane
+                    Point3f x = p + (q - p) * ((plane - p[a]) / (q[a] - p[a]));
+                    x[a] = plane;
+                    clipped[m++] = x;
+                }
+            }
+            std::copy(clipped, clipped + m, poly);
+            n = m;
+        }
+    }
+
+    BoundingBox3f bb;
+    for (int k = 0; k < n; ++k)
+    {
+        bb.expandBy(poly[k]);
+    }
+    //(Round-off may leave the clipped points slightly outside the box)
+    if (bb.isValid()) bb.clip(box);
+    return bb;
+}
+
+uint32_t AccelTree::addLeafTris(const std::vector<TriInd>& tris)
+{
+    tbb::spin_mutex::scoped_lock lock(leafTrisMutex);
+    auto first = (uint32_t)leafTris.size();
+    leafTris.insert(leafTris.end(), tris.begin(), tris.end());
+    return first;
+}
+
+void AccelTree::buildTriAccels()
+{
+    triAccels.clear();
+    if (!precomputeTris) return;
+
+    triAccels.resize(leafTris.size());
+    tbb::parallel_for(std::size_t(0), leafTris.size(),
+                      [this](std::size_t i)
+                      {
+                          triAccels[i] = TriAccel(meshes[leafTris[i].mesh], leafTris[i].i);
+                      });
+
+    std::cout << "Precomputed Tri Memory: " << memString(triAccels.size() * sizeof(TriAccel)) << std::endl;
 }
 NORI_NAMESPACE_END
\ No newline at end of file
@@ -0,0 +1,223 @@
+//
+// A bounding interval hierarchy: a binary tree whose nodes only store two clip planes along
+//     their split axis (the upper bound of the first child, and the lower bound of the second).
+//
+
+#include "nori/BIH.h"
+
+#include <chrono>
+
+NORI_NAMESPACE_BEGIN
+
+static_assert(sizeof(BIH::Node) == 12, "BIH nodes should stay 12 bytes");
+
+void BIH::build()
+{
+    if(built) return;
+    built = true;
+
+    //Only the BVH's split code is used, over its leafTris (no BVH nodes are ever allocated)
+    BVH splitter(m_method);
+    uint32_t triCt = 0;
+    for (auto mesh: meshes)
+    {
+        splitter.addMesh(mesh);
+        triCt += mesh->getTriangleCount();
+    }
+    splitter.leafTris.reserve(triCt);
+    for (std::size_t i = 0; i < meshes.size(); ++i)
+    {
+        for (uint32_t t = 0; t < meshes[i]->getTriangleCount(); ++t)
+        {
+            splitter.leafTris.emplace_back(i, t);
+        }
+    }
+
+    //Build (& time) the BIH
+    auto startT = std::chrono::high_resolution_clock::now();
+    nodes.clear();
+    if (triCt > 0)
+    {
+        nodes.resize(1);
+        build(splitter, 0, bbox, bbox, 0, triCt, 0);
+    }
+    nodes.shrink_to_fit();
+    leafTris.swap(splitter.leafTris);
+    auto endT = std::chrono::high_resolution_clock::now();
+    auto durT = std::chrono::duration_cast<std::chrono::milliseconds>(endT-startT);
+
+    //Print some information
+    std::cout << "Acceleration Structure: BIH" << std::endl;
+    std::cout << "Nodes: " << nodes.size() << ", Tree Stored Tris: " << leafTris.size() << std::endl;
+    std::cout << "Node Memory: " << memString(nodes.size() * sizeof(Node)) << std::endl;
+    std::cout << "BIH Construction Time: " << durT.count() << " MS" << endl;
+
+    //Store the triangles themselves in leaf order, if enabled
+    buildTriAccels();
+}
+
+void BIH::build(BVH &splitter, uint32_t index, const BoundingBox3f &bb, const BoundingBox3f &clipBB,
+                uint32_t start, uint32_t end, int depth)
+{
+    //Same leaf criteria as the BVH
+    BVH::SplitData s;
+    if (end - start > BVH::FEW_TRIS && depth < BVH::MAX_DEPTH)
+        s = splitter.getGoodSplit(bb, start, end, m_method);
+    if (s.dim == -1)
+    {
+        nodes[index] = Node::leaf(start, end - start);
+        return;
+    }
+
+    //The children's triangle ranges (already partitioned) and bounds
+    auto mid = start + (uint32_t)s.index;
+    uint32_t starts[2]{start, mid}, ends[2]{mid, end};
+    BoundingBox3f childBBs[2]{s.bb1, s.bb2};
+
+    //Pick the axis (and which child is the lower one along it) whose clip planes cut the
+    //  node's box into the smallest children. (Not necessarily the split axis, as the BIH
+    //  does not keep the children's bounds along the other axes.)
+    int bestD = 0;
+    bool bestSwap = false;
+    float bestSA = std::numeric_limits<float>::infinity();
+    BoundingBox3f bestClipBBs[2];
+    for (int d = 0; d < 3; ++d)
+    {
+        bool swap = childBBs[1].getCenter()[d] < childBBs[0].getCenter()[d];
+        const BoundingBox3f& low = childBBs[swap ? 1 : 0];
+        const BoundingBox3f& high = childBBs[swap ? 0 : 1];
+        BoundingBox3f clipBBs[2]{clipBB, clipBB};
+        clipBBs[0].max[d] = std::min(clipBB.max[d], low.max[d]);
+        clipBBs[1].min[d] = std::max(clipBB.min[d], high.min[d]);
+        float sa = clipBBs[0].getSurfaceArea() + clipBBs[1].getSurfaceArea();
+        if (sa < bestSA)
+        {
+            bestSA = sa;
+            bestD = d;
+            bestSwap = swap;
+            bestClipBBs[0] = clipBBs[0];
+            bestClipBBs[1] = clipBBs[1];
+        }
+    }
+    if (bestSwap)
+    {
+        std::swap(starts[0], starts[1]);
+        std::swap(ends[0], ends[1]);
+        std::swap(childBBs[0], childBBs[1]);
+    }
+
+    //Both children are stored next to each other
+    auto children = (uint32_t)nodes.size();
+    nodes.resize(children + 2);
+    nodes[index] = Node::interior(bestD, childBBs[0].max[bestD], childBBs[1].min[bestD], children);
+
+    for (int c = 0; c < 2; ++c)
+    {
+        build(splitter, children + c, childBBs[c], bestClipBBs[c], starts[c], ends[c], depth + 1);
+    }
+}
+
+BIH::TriInd BIH::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const
+{
+    if (nodes.empty()) return {};
+
+    float tMin, tMax;
+    if (!bbox.rayIntersect(ray_, tMin, tMax)) return {};
+    tMin = std::max(tMin, ray_.mint);
+
+    /// A far child to visit later, and the ray's interval within it
+    struct StackEntry
+    {
+        uint32_t node;
+        float tMin, tMax;
+    };
+    StackEntry stack[STACK_SIZE];
+    ///Stack index
+    int si = -1;
+
+    TriInd closeTri = {};
+    Ray3f ray(ray_); /// Shortened to the closest hit so far
+    uint32_t node = 0;
+    while (true)
+    {
+        //Descend along [tMin, tMax], clipping it to each child's interval along the split axis.
+        //  (The children may overlap, so the closest hit is only known once no node is left
+        //  whose interval starts before it.)
+        tMax = std::min(tMax, ray.maxt);
+        bool visit = tMin <= tMax;
+        while (visit && !nodes[node].isLeaf())
+        {
+            const Node& n = nodes[node];
+            int d = n.axis();
+            uint32_t low = n.children(), high = low + 1;
+
+            if (ray.d[d] == 0)
+            { //The ray stays on one side of each clip plane
+                bool inLow = ray.o[d] <= n.clip[0], inHigh = ray.o[d] >= n.clip[1];
+                if (inLow && inHigh) stack[++si] = {high, tMin, tMax};
+                if (inLow) node = low;
+                else if (inHigh) node = high;
+                else visit = false;
+                continue;
+            }
+
+            //Where the ray leaves the near child, and enters the far one
+            float tLowPlane = (n.clip[0] - ray.o[d]) * ray.dRcp[d];
+            float tHighPlane = (n.clip[1] - ray.o[d]) * ray.dRcp[d];
+            bool up = ray.d[d] > 0;
+            uint32_t nearChild = up ? low : high, farChild = up ? high : low;
+            float tNearEnd = up ? tLowPlane : tHighPlane, tFarStart = up ? tHighPlane : tLowPlane;
+
+            bool nearHit = tMin <= tNearEnd, farHit = tFarStart <= tMax;
+            if (nearHit && farHit)
+            {
+                stack[++si] = {farChild, std::max(tMin, tFarStart), tMax};
+                node = nearChild;
+                tMax = std::min(tMax, tNearEnd);
+            }
+            else if (nearHit)
+            {
+                node = nearChild;
+                tMax = std::min(tMax, tNearEnd);
+            }
+            else if (farHit)
+            {
+                node = farChild;
+                tMin = std::max(tMin, tFarStart);
+            }
+            else visit = false;
+        }
+
+        if (visit)
+        {
+            const Node& n = nodes[node];
+            for (uint32_t i = n.first; i < n.first + n.triCount(); ++i)
+            {
+                const TriInd &idx = leafTris[i];
+                float u, v, t;
+                if (leafTriIntersect(i, ray, u, v, t))
+                {
+                    /* An intersection was found! Can terminate
+                       immediately if this is a shadow ray query */
+                    if (shadowRay)
+                        return idx;
+                    ray.maxt = its.t = t;
+                    its.uv = Point2f(u, v);
+                    its.mesh = meshes[idx.mesh];
+                    closeTri = idx;
+                }
+            }
+        }
+
+        //Continue with the next far child (skipped above if it starts beyond the closest hit)
+        if (si < 0) break;
+        node = stack[si].node;
+        tMin = stack[si].tMin;
+        tMax = stack[si].tMax;
+        --si;
+    }
+
+    return closeTri;
+}
+
+NORI_NAMESPACE_END
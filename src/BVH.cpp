@@ -6,6 +6,11 @@
 
 #include <chrono>
 #include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+#include <algorithm>
+#include <array>
+#include <functional>
 
 //Set to true for parallel construction of BVH
 #define BVH_PARALLEL true
@@ -14,6 +19,14 @@
 /// Greatly improves speed, but decreases image accuracy
 #define QUICK_RETURN false
 
+//Whether SSE is available for the packet box tests (otherwise a scalar loop is used)
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define BVH_SSE true
+#include <xmmintrin.h>
+#else
+#define BVH_SSE false
+#endif
+
 NORI_NAMESPACE_BEGIN
 
 void BVH::build(SplitMethod method) {
@@ -26,85 +39,813 @@ void BVH::build(SplitMethod method) {
     {
         triCt += mesh->getTriangleCount();
     }
-    auto tris = new std::vector<TriInd>(triCt);
+    leafTris.resize(triCt);
     std::size_t curInd = 0;
     for(std::size_t i = 0; i < meshes.size(); ++i)
     {
         for(uint32_t t = 0; t < meshes[i]->getTriangleCount(); ++t)
         {
-            (*tris)[curInd] = TriInd(i, t);
+            leafTris[curInd] = TriInd(i, t);
             ++curInd;
         }
     }
 
     //Build (& time) BVH
     auto startT = std::chrono::high_resolution_clock::now();
-    root = build(bbox, tris, 0, method);
+    Node* root;
+    if (method == LBVH)
+        root = buildLBVH();
+    else if (method == SBVH)
+        root = buildSBVH();
+    else
+        root = build(bbox, 0, triCt, 0, method);
+
+    //Optionally restructure treelets to lower the SAH cost of the tree
+    float costBefore = 0, costAfter = 0;
+    if (m_optimizeTreelets)
+    {
+        costBefore = computeCosts(root);
+        for (int r = 0; r < TREELET_ROUNDS; ++r)
+        {
+            optimizeTreelets(root, 0);
+        }
+        costAfter = root->cost;
+
+        //(Normalized by the root's area, so the costs read as expected traversal costs per ray)
+        float rootSA = root->AABB.getSurfaceArea();
+        costBefore /= rootSA;
+        costAfter /= rootSA;
+    }
+
+    //Linearize the tree for traversal, then free the pointer-based tree
+    nodes.clear();
+    nodes.reserve(root->nodeCount());
+    flatten(root, 0);
+    delete root;
     auto endT = std::chrono::high_resolution_clock::now();
     auto durT = std::chrono::duration_cast<std::chrono::milliseconds>(endT-startT);
 
     //Print some information
     std::cout << "Acceleration Structure: BVH" << std::endl;
-    std::cout << "Nodes: " << root->nodeCount() << ", Tree Stored Tris: " << root->triCount() << ", Mesh Tris: " << triCt << std::endl;
+    std::cout << "Nodes: " << nodes.size() << ", Tree Stored Tris: " << leafTris.size() << ", Mesh Tris: " << triCt << std::endl;
+    std::cout << "Node Memory: " << memString(nodes.size() * sizeof(LinearNode)) << std::endl;
+    if (m_optimizeTreelets)
+        std::cout << "Treelet Optimization SAH Cost: " << costBefore << " -> " << costAfter << std::endl;
     std::cout << "BVH Construction Time: " << durT.count() << " MS" << endl;
 
+    //Store the triangles themselves in leaf order, if enabled
+    buildTriAccels();
+
+    //Remember the tree's quality, so refit() can tell when it has degraded too much
+    if (m_rebuildRatio > 0)
+        m_builtCost = sahCost(0);
+}
+
+void BVH::refit()
+{
+    if (!built) return;
+
+    auto startT = std::chrono::high_resolution_clock::now();
+    refitMeshes();
+    refitNode(0, 0);
+    auto endT = std::chrono::high_resolution_clock::now();
+    auto durT = std::chrono::duration_cast<std::chrono::milliseconds>(endT-startT);
+
+    std::cout << "BVH Refit Time: " << durT.count() << " MS" << endl;
+
+    if (m_rebuildRatio > 0)
+    {
+        float cost = sahCost(0);
+        if (cost > m_rebuildRatio * m_builtCost)
+        { //The tree no longer fits the triangles well, so start over
+            std::cout << "BVH SAH Cost: " << m_builtCost << " -> " << cost << ", rebuilding" << std::endl;
+            built = false;
+            build();
+        }
+    }
+}
+
+void BVH::refitNode(uint32_t index, int depth)
+{
+    LinearNode& n = nodes[index];
+    if (n.isLeaf())
+    {
+        BoundingBox3f bb;
+        for (uint32_t i = n.offset; i < n.offset + n.triCount; ++i)
+        {
+            bb.expandBy(getTriBB(leafTris[i]));
+        }
+        n.AABB = bb;
+        return;
+    }
+
+    uint32_t children[2]{index + 1, n.offset};
+#if BVH_PARALLEL
+    if (depth < REFIT_PARALLEL_DEPTH)
+    {
+        tbb::parallel_for(int(0), 2, [=](int i) {refitNode(children[i], depth + 1);});
+    }
+    else
+#endif
+    {
+        for (uint32_t c : children)
+        {
+            refitNode(c, depth + 1);
+        }
+    }
+
+    n.AABB = nodes[children[0]].AABB;
+    n.AABB.expandBy(nodes[children[1]].AABB);
+    n.occludeFirst = occludeFirst(nodes[children[0]].AABB, nodes[children[1]].AABB);
+}
+
+float BVH::sahCost(uint32_t index) const
+{
+    if (nodes.empty()) return 0;
+
+    //Sums the unnormalized costs of the subtree
+    std::function<float(uint32_t)> cost = [&](uint32_t i) -> float {
+        const LinearNode& n = nodes[i];
+        float sa = n.AABB.getSurfaceArea();
+        if (n.isLeaf())
+            return TRI_INT_COST * sa * (float)n.triCount;
+        return TRAVERSAL_TIME * sa + cost(i + 1) + cost(n.offset);
+    };
+
+    float rootSA = nodes[index].AABB.getSurfaceArea();
+    return rootSA > 0 ? cost(index) / rootSA : 0;
 }
-BVH::Node *BVH::build(const nori::BoundingBox3f& bb, std::vector<TriInd> *tris, int depth, SplitMethod method)
+BVH::Node *BVH::build(const nori::BoundingBox3f& bb, uint32_t start, uint32_t end, int depth, SplitMethod method)
 {
     //Few triangles
-    if (tris->size() <= FEW_TRIS || depth >= MAX_DEPTH)
+    if (end - start <= FEW_TRIS || depth >= MAX_DEPTH)
     {
-        return new Node(bb, tris, -1);
+        return new Node(bb, start, end, -1);
     }
 
-    SplitData s = getGoodSplit(bb, tris, method);
+    SplitData s = getGoodSplit(bb, start, end, method);
 
     if( s.dim == -1 )
     { //No advantage to splitting
         //std::cout << "invalid" << std::endl;
-        return new Node(bb, tris, -1);
+        return new Node(bb, start, end, -1);
     }
 
 
     //Set up AABBs
     BoundingBox3f AABBs[2]{s.bb1,s.bb2};
-    //& Count up triangles into vector "triangles"
-    std::vector<TriInd>* triangles[2]{s.tris1,s.tris2};
+    //& the (already partitioned) triangle ranges of the children
+    uint32_t mid = start + (uint32_t)s.index;
+    uint32_t starts[2]{start, mid};
+    uint32_t ends[2]{mid, end};
 
-    Node* n = new Node(bb, nullptr, s.dim);
+    Node* n = new Node(bb, start, end, s.dim);
 #if BVH_PARALLEL
     tbb::parallel_for(int(0), 2,
                       [=](int i)
-                      {n->children[i] = build(AABBs[i], triangles[i], depth + 1, method);});
+                      {n->children[i] = build(AABBs[i], starts[i], ends[i], depth + 1, method);});
 #else
     for (int i = 0; i < 2; ++i)
     {
-        n->children[i] = build(AABBs[i], triangles[i], depth + 1, method);
+        n->children[i] = build(AABBs[i], starts[i], ends[i], depth + 1, method);
     }
 #endif
 
-    //we arent using this specific vector anymore, so delete it
-    delete tris;
+    return n;
+}
+
+/// Runs f(block, begin, end) over [0, n) split into blocks, in parallel if enabled.
+/// \return The number of blocks
+template <typename F>
+static std::size_t forEachBlock(std::size_t n, std::size_t minBlockSize, const F& f)
+{
+    std::size_t blocks = std::max<std::size_t>(1, std::min<std::size_t>(64, n / minBlockSize));
+    std::size_t blockSize = (n + blocks - 1) / blocks;
+    auto run = [&](std::size_t b) { f(b, std::min(n, b * blockSize), std::min(n, (b + 1) * blockSize)); };
+#if BVH_PARALLEL
+    tbb::parallel_for(std::size_t(0), blocks, run);
+#else
+    for (std::size_t b = 0; b < blocks; ++b) run(b);
+#endif
+    return blocks;
+}
+
+/// Spreads the low 21 bits of v out to every third bit.
+static uint64_t expandBits(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+void BVH::radixSort(std::vector<MortonTri>& tris)
+{
+    //Each pass histograms and then scatters blocks of the array in parallel.
+    //  Passes over a digit that every code shares are skipped.
+    std::vector<MortonTri> tmp(tris.size());
+    std::vector<std::array<uint32_t, 256>> counts(64);
+
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        std::size_t blocks = forEachBlock(tris.size(), 16384,
+                                          [&](std::size_t b, std::size_t begin, std::size_t end) {
+            counts[b].fill(0);
+            for (std::size_t i = begin; i < end; ++i) ++counts[b][(tris[i].code >> shift) & 0xFF];
+        });
+
+        //Exclusive prefix sum in (digit, block) order, so each block knows where to scatter to
+        uint32_t sum = 0;
+        bool shared = false;
+        for (int d = 0; d < 256; ++d)
+        {
+            uint32_t digitStart = sum;
+            for (std::size_t b = 0; b < blocks; ++b)
+            {
+                uint32_t c = counts[b][d];
+                counts[b][d] = sum;
+                sum += c;
+            }
+            if (sum - digitStart == tris.size()) shared = true;
+        }
+        if (shared) continue;
+
+        forEachBlock(tris.size(), 16384, [&](std::size_t b, std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i) tmp[counts[b][(tris[i].code >> shift) & 0xFF]++] = tris[i];
+        });
+        tris.swap(tmp);
+    }
+}
+
+BVH::Node *BVH::buildLBVH()
+{
+    auto triCt = (uint32_t)leafTris.size();
+    if (triCt == 0) return new Node(bbox, 0, 0, -1);
+
+    //1. Bound the triangle centroids, to quantize them within
+    BoundingBox3f cbb = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0, triCt, PARALLEL_BIN_TRIS / 4), BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &r, BoundingBox3f cb) {
+                for (uint32_t i = r.begin(); i < r.end(); ++i)
+                    cb.expandBy(meshes[leafTris[i].mesh]->getCentroid(leafTris[i].i));
+                return cb;
+            },
+            [](BoundingBox3f a, const BoundingBox3f &b) { a.expandBy(b); return a; });
+
+    //2. Morton codes (21 bits per axis, x in the highest bit of each triple)
+    std::vector<MortonTri> sorted(triCt);
+    Vector3f ext = cbb.getExtents();
+    const float cells = (float)((1 << 21) - 1);
+    forEachBlock(triCt, 16384, [&](std::size_t, std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            const TriInd &t = leafTris[i];
+            Point3f c = meshes[t.mesh]->getCentroid(t.i);
+            uint64_t q[3];
+            for (int d = 0; d < 3; ++d)
+            {
+                float rel = ext[d] > 0 ? (c[d] - cbb.min[d]) / ext[d] : 0.f;
+                q[d] = (uint64_t)std::min(std::max(rel * cells, 0.f), cells);
+            }
+            sorted[i] = {(expandBits(q[0]) << 2) | (expandBits(q[1]) << 1) | expandBits(q[2]), t};
+        }
+    });
+
+    //3. Sort along the curve, and emit the hierarchy
+    radixSort(sorted);
+    for (uint32_t i = 0; i < triCt; ++i)
+    {
+        leafTris[i] = sorted[i].tri;
+    }
+
+    return buildLBVH(sorted, 0, triCt, 0);
+}
+
+BVH::Node *BVH::buildLBVH(const std::vector<MortonTri> &sorted, uint32_t start, uint32_t end, int depth)
+{
+    if (end - start <= LBVH_LEAF_TRIS || depth >= LBVH_MAX_DEPTH)
+    {
+        BoundingBox3f bb;
+        for (uint32_t i = start; i < end; ++i)
+        {
+            bb.expandBy(getTriBB(leafTris[i]));
+        }
+        return new Node(bb, start, end, -1);
+    }
+
+    //Split where the highest differing bit of the range flips (the codes are sorted,
+    //  so every code before that point has it unset). Identical codes split in half.
+    uint32_t mid = start + (end - start) / 2;
+    int dim = 0;
+    uint64_t diff = sorted[start].code ^ sorted[end - 1].code;
+    if (diff != 0)
+    {
+        int bit = 63;
+        while (!((diff >> bit) & 1)) --bit;
+        dim = 2 - bit % 3;
+
+        uint64_t mask = 1ull << bit;
+        mid = (uint32_t)(std::partition_point(sorted.begin() + start, sorted.begin() + end,
+                                              [mask](const MortonTri &t) { return !(t.code & mask); })
+                         - sorted.begin());
+    }
 
+    uint32_t starts[2]{start, mid};
+    uint32_t ends[2]{mid, end};
+    Node* children[2];
+#if BVH_PARALLEL
+    if (end - start >= LBVH_PARALLEL_TRIS)
+    {
+        tbb::parallel_for(int(0), 2,
+                          [&](int i)
+                          {children[i] = buildLBVH(sorted, starts[i], ends[i], depth + 1);});
+    }
+    else
+#endif
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            children[i] = buildLBVH(sorted, starts[i], ends[i], depth + 1);
+        }
+    }
+
+    BoundingBox3f bb = children[0]->AABB;
+    bb.expandBy(children[1]->AABB);
+    Node* n = new Node(bb, start, end, dim);
+    n->children[0] = children[0];
+    n->children[1] = children[1];
     return n;
 }
 
+BVH::Node *BVH::buildSBVH()
+{
+    //Start with one reference per triangle, and collect the leaves' references anew
+    auto* refs = new std::vector<SBVHRef>(leafTris.size());
+    BoundingBox3f bb;
+    for (std::size_t i = 0; i < leafTris.size(); ++i)
+    {
+        (*refs)[i] = {leafTris[i], getTriBB(leafTris[i])};
+        bb.expandBy((*refs)[i].bb);
+    }
+    std::atomic<long long> budget((long long)(SBVH_DUPLICATION * (float)leafTris.size()));
+    leafTris.clear();
+
+    if (refs->empty())
+    {
+        delete refs;
+        return new Node(bbox, 0, 0, -1);
+    }
+
+    Node* root = buildSBVH(bb, refs, 0, bb.getSurfaceArea(), budget);
+    leafTris.shrink_to_fit();
+    return root;
+}
+
+BVH::Node *BVH::buildSBVH(const BoundingBox3f &bb, std::vector<SBVHRef> *refs, int depth,
+                          float rootSA, std::atomic<long long> &budget)
+{
+    std::size_t refCt = refs->size();
+    auto makeLeaf = [&]() {
+        std::vector<TriInd> tris(refCt);
+        for (std::size_t i = 0; i < refCt; ++i)
+        {
+            tris[i] = (*refs)[i].tri;
+        }
+        delete refs;
+        uint32_t start = addLeafTris(tris);
+        return new Node(bb, start, start + (uint32_t)refCt, -1);
+    };
+
+    //Few triangles
+    if (refCt <= FEW_TRIS || depth >= MAX_DEPTH)
+    {
+        return makeLeaf();
+    }
+
+    float bbSA = bb.getSurfaceArea();
+    float minSAH = TRI_INT_COST * refCt;
+
+    //1. Object split: SAH buckets over the centers of the references
+    BoundingBox3f cbb;
+    for (const auto &r: *refs)
+    {
+        cbb.expandBy(r.bb.getCenter());
+    }
+    int objD = -1;
+    int objI = 0;
+    BoundingBox3f objBB1, objBB2;
+    for (int d = 0; d < 3; ++d)
+    {
+        Bucket buckets[BUCKETS];
+        for (const auto &r: *refs)
+        {
+            int b = bucketIndex(cbb, r.bb.getCenter(), d);
+            ++buckets[b].count;
+            buckets[b].bb.expandBy(r.bb);
+        }
+
+        BoundingBox3f backAABBs[BUCKETS];
+        backAABBs[BUCKETS-1] = buckets[BUCKETS-1].bb;
+        for (int i = BUCKETS - 2; i >= 0; --i) {
+            backAABBs[i] = backAABBs[i + 1];
+            backAABBs[i].expandBy(buckets[i].bb);
+        }
+
+        BoundingBox3f curBB;
+        std::size_t lCt = 0;
+        for (std::size_t i = 0; i < BUCKETS - 1; ++i)
+        {
+            curBB.expandBy(buckets[i].bb);
+            lCt += buckets[i].count;
+            if (lCt == 0 || lCt == refCt) continue;
+
+            float sah = TRAVERSAL_TIME + TRI_INT_COST*(curBB.getSurfaceArea() * (float)lCt +
+                                          backAABBs[i + 1].getSurfaceArea() * (float)(refCt - lCt)) / bbSA;
+            if (sah < minSAH)
+            {
+                minSAH = sah;
+                objD = d;
+                objI = (int)i;
+                objBB1 = curBB;
+                objBB2 = backAABBs[i + 1];
+            }
+        }
+    }
+
+    //2. Spatial split, only if the object split's children overlap noticeably
+    int spD = -1;
+    int spI = 0;
+    float spPos = 0;
+    long long spDuplicates = 0;
+    BoundingBox3f overlap = objBB1;
+    overlap.clip(objBB2);
+    if (objD == -1 || (overlap.isValid() && overlap.getSurfaceArea() > SBVH_ALPHA * rootSA))
+    {
+        for (int d = 0; d < 3; ++d)
+        {
+            float binW = (bb.max[d] - bb.min[d]) / SBVH_SPATIAL_BINS;
+            if (!(binW > 0)) continue;
+            auto binOf = [&](float x) {
+                auto b = (int)((x - bb.min[d]) / binW);
+                return std::min(std::max(b, 0), SBVH_SPATIAL_BINS - 1);
+            };
+
+            //Each reference is clipped into every bin it spans, and counted where it enters and exits
+            BoundingBox3f bins[SBVH_SPATIAL_BINS];
+            std::size_t entries[SBVH_SPATIAL_BINS]{}, exits[SBVH_SPATIAL_BINS]{};
+            for (const auto &r: *refs)
+            {
+                int b0 = binOf(r.bb.min[d]), b1 = binOf(r.bb.max[d]);
+                ++entries[b0];
+                ++exits[b1];
+                if (b0 == b1)
+                {
+                    bins[b0].expandBy(r.bb);
+                    continue;
+                }
+                for (int b = b0; b <= b1; ++b)
+                {
+                    BoundingBox3f slab = r.bb;
+                    if (b > b0) slab.min[d] = bb.min[d] + binW * b;
+                    if (b < b1) slab.max[d] = bb.min[d] + binW * (b + 1);
+                    BoundingBox3f part = clippedTriBB(r.tri, slab);
+                    if (part.isValid()) bins[b].expandBy(part);
+                }
+            }
+
+            BoundingBox3f backAABBs[SBVH_SPATIAL_BINS];
+            std::size_t backCts[SBVH_SPATIAL_BINS];
+            backAABBs[SBVH_SPATIAL_BINS-1] = bins[SBVH_SPATIAL_BINS-1];
+            backCts[SBVH_SPATIAL_BINS-1] = exits[SBVH_SPATIAL_BINS-1];
+            for (int i = SBVH_SPATIAL_BINS - 2; i >= 0; --i) {
+                backAABBs[i] = backAABBs[i + 1];
+                backAABBs[i].expandBy(bins[i]);
+                backCts[i] = backCts[i + 1] + exits[i];
+            }
+
+            BoundingBox3f curBB;
+            std::size_t lCt = 0;
+            for (int i = 0; i < SBVH_SPATIAL_BINS - 1; ++i)
+            {
+                curBB.expandBy(bins[i]);
+                lCt += entries[i];
+                std::size_t hCt = backCts[i + 1];
+                if (lCt == 0 || hCt == 0) continue;
+
+                auto duplicates = (long long)(lCt + hCt - refCt);
+                if (duplicates > budget.load()) continue;
+
+                float sah = TRAVERSAL_TIME + TRI_INT_COST*(curBB.getSurfaceArea() * (float)lCt +
+                                              backAABBs[i + 1].getSurfaceArea() * (float)hCt) / bbSA;
+                if (sah < minSAH)
+                {
+                    minSAH = sah;
+                    spD = d;
+                    spI = i;
+                    spPos = bb.min[d] + binW * (i + 1);
+                    spDuplicates = duplicates;
+                }
+            }
+        }
+    }
+
+    //No advantage to splitting
+    if (objD == -1 && spD == -1)
+    {
+        return makeLeaf();
+    }
+
+    //3. Distribute the references to the children
+    auto* childRefs = new std::vector<SBVHRef>[2];
+    int dim;
+    if (spD != -1)
+    { //(The spatial split was better, since it was only kept if it beat every object split)
+        dim = spD;
+        budget -= spDuplicates;
+        float binW = (bb.max[dim] - bb.min[dim]) / SBVH_SPATIAL_BINS;
+        for (const auto &r: *refs)
+        {
+            //(Classified by bin, exactly as they were counted)
+            int b0 = std::min(std::max((int)((r.bb.min[dim] - bb.min[dim]) / binW), 0), SBVH_SPATIAL_BINS - 1);
+            int b1 = std::min(std::max((int)((r.bb.max[dim] - bb.min[dim]) / binW), 0), SBVH_SPATIAL_BINS - 1);
+            if (b1 <= spI)
+            {
+                childRefs[0].push_back(r);
+            }
+            else if (b0 > spI)
+            {
+                childRefs[1].push_back(r);
+            }
+            else
+            { //Straddles the plane, so split the reference in two
+                BoundingBox3f low = r.bb, high = r.bb;
+                low.max[dim] = spPos;
+                high.min[dim] = spPos;
+                low = clippedTriBB(r.tri, low);
+                high = clippedTriBB(r.tri, high);
+                if (low.isValid()) childRefs[0].push_back({r.tri, low});
+                if (high.isValid()) childRefs[1].push_back({r.tri, high});
+            }
+        }
+    }
+    else
+    {
+        dim = objD;
+        for (const auto &r: *refs)
+        {
+            childRefs[bucketIndex(cbb, r.bb.getCenter(), dim) <= objI ? 0 : 1].push_back(r);
+        }
+    }
+    delete refs;
+
+    //(Clipping can empty a side, in which case there is nothing to split)
+    if (childRefs[0].empty() || childRefs[1].empty())
+    {
+        refs = new std::vector<SBVHRef>(std::move(childRefs[childRefs[0].empty() ? 1 : 0]));
+        refCt = refs->size();
+        delete[] childRefs;
+        return makeLeaf();
+    }
+
+    BoundingBox3f AABBs[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        for (const auto &r: childRefs[i])
+        {
+            AABBs[i].expandBy(r.bb);
+        }
+    }
+
+    Node* n = new Node(bb, 0, 0, dim);
+    auto buildChild = [&](int i) {
+        auto* cRefs = new std::vector<SBVHRef>(std::move(childRefs[i]));
+        n->children[i] = buildSBVH(AABBs[i], cRefs, depth + 1, rootSA, budget);
+    };
+#if BVH_PARALLEL
+    tbb::parallel_for(int(0), 2, buildChild);
+#else
+    for (int i = 0; i < 2; ++i)
+    {
+        buildChild(i);
+    }
+#endif
+    delete[] childRefs;
+
+    return n;
+}
+
+float BVH::computeCosts(Node *n) const
+{
+    float sa = n->AABB.getSurfaceArea();
+    if (n->isLeaf())
+    {
+        n->cost = TRI_INT_COST * sa * (float)n->triCount();
+
+        //(Leaves with too many triangles for one node are halved by flattenLeaf())
+        n->height = 0;
+        for (std::size_t c = n->triCount(); c > MAX_LEAF_TRIS; c = (c + 1) / 2)
+            ++n->height;
+    }
+    else
+    {
+        n->cost = TRAVERSAL_TIME * sa + computeCosts(n->children[0]) + computeCosts(n->children[1]);
+        n->height = 1 + std::max(n->children[0]->height, n->children[1]->height);
+    }
+    return n->cost;
+}
+
+void BVH::optimizeTreelets(Node *n, int depth) const
+{
+    if (n->isLeaf()) return;
+
+#if BVH_PARALLEL
+    tbb::parallel_for(int(0), 2, [=](int i) {optimizeTreelets(n->children[i], depth + 1);});
+#else
+    for (int i = 0; i < 2; ++i)
+    {
+        optimizeTreelets(n->children[i], depth + 1);
+    }
+#endif
+
+    restructureTreelet(n, depth);
+}
+
+/// Returns the index of the lowest set bit of s (which must not be 0).
+static int lowestBit(int s)
+{
+    int i = 0;
+    while (!((s >> i) & 1)) ++i;
+    return i;
+}
+
+void BVH::restructureTreelet(Node *n, int depth) const
+{
+    //1. Grow the treelet, by repeatedly opening the (interior) treelet leaf with the largest area
+    Node* leaves[TREELET_LEAVES]{n->children[0], n->children[1]};
+    Node* interiors[TREELET_LEAVES - 1]{n};
+    int leafCt = 2, interiorCt = 1;
+    while (leafCt < TREELET_LEAVES)
+    {
+        int best = -1;
+        float bestSA = -1;
+        for (int i = 0; i < leafCt; ++i)
+        {
+            float sa = leaves[i]->AABB.getSurfaceArea();
+            if (!leaves[i]->isLeaf() && sa > bestSA)
+            {
+                best = i;
+                bestSA = sa;
+            }
+        }
+        if (best == -1) break;
+
+        Node* opened = leaves[best];
+        interiors[interiorCt++] = opened;
+        leaves[best] = opened->children[0];
+        leaves[leafCt++] = opened->children[1];
+    }
+    if (leafCt < 3) return; //Two leaves only have one arrangement
+
+    //2. The cheapest arrangement of every subset of the leaves (in increasing order, so
+    //  that all subsets of a set come before it)
+    const int full = (1 << leafCt) - 1;
+    BoundingBox3f bbs[1 << TREELET_LEAVES];
+    float cost[1 << TREELET_LEAVES];
+    int split[1 << TREELET_LEAVES];
+    int height[1 << TREELET_LEAVES];
+    for (int s = 1; s <= full; ++s)
+    {
+        int low = lowestBit(s);
+        int rest = s & (s - 1);
+        if (rest == 0)
+        {
+            bbs[s] = leaves[low]->AABB;
+            cost[s] = leaves[low]->cost;
+            height[s] = leaves[low]->height;
+            continue;
+        }
+
+        bbs[s] = bbs[rest];
+        bbs[s].expandBy(leaves[low]->AABB);
+
+        //Try every partition into two sets (the one with the lowest leaf goes first, to
+        //  skip mirrored partitions)
+        float bestCost = std::numeric_limits<float>::infinity();
+        for (int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+        {
+            if (!(p & (1 << low))) continue;
+            float c = cost[p] + cost[s ^ p];
+            if (c < bestCost)
+            {
+                bestCost = c;
+                split[s] = p;
+            }
+        }
+        cost[s] = TRAVERSAL_TIME * bbs[s].getSurfaceArea() + bestCost;
+        height[s] = 1 + std::max(height[split[s]], height[s ^ split[s]]);
+    }
+
+    //The current arrangement is one of those tried, so only rebuild on a real improvement
+    if (!(cost[full] < n->cost)) return;
+
+    //Rearranging can turn a balanced treelet into a chain, so reject arrangements that would
+    //  push any node past what flatten() accepts (unless the tree was already that deep)
+    int maxHeight = std::max(STACK_SIZE - 1 - depth, n->height);
+    if (height[full] > maxHeight) return;
+
+    //3. Rebuild the treelet in that arrangement, reusing its interior nodes (n stays its root)
+    int nextInterior = 0;
+    std::function<Node*(int)> emit = [&](int s) -> Node* {
+        if ((s & (s - 1)) == 0) return leaves[lowestBit(s)];
+
+        Node* in = interiors[nextInterior++];
+        Node* c0 = emit(split[s]);
+        Node* c1 = emit(s ^ split[s]);
+
+        //Split along the axis that best separates the children, with the lower child first
+        Point3f p0 = c0->AABB.getCenter(), p1 = c1->AABB.getCenter();
+        Vector3f sep = (p1 - p0).cwiseAbs();
+        int dim = sep.x() >= sep.y() ? (sep.x() >= sep.z() ? 0 : 2) : (sep.y() >= sep.z() ? 1 : 2);
+        if (p1[dim] < p0[dim]) std::swap(c0, c1);
+
+        in->children[0] = c0;
+        in->children[1] = c1;
+        in->dim = dim;
+        in->AABB = bbs[s];
+        in->cost = cost[s];
+        in->height = height[s];
+        return in;
+    };
+    emit(full);
+}
+
+uint32_t BVH::flatten(const Node *n, int depth)
+{
+    if (n->isLeaf())
+    {
+        return flattenLeaf(n->AABB, n->triStart, n->triCount(), depth);
+    }
+
+    if (depth >= STACK_SIZE - 1)
+        throw NoriException("BVH::flatten(): tree is too deep for the traversal stack!");
+
+    auto index = (uint32_t)nodes.size();
+    nodes.push_back({n->AABB, 0, 0, (uint8_t)n->dim, 0});
+
+    //First child directly follows its parent
+    flatten(n->children[0], depth + 1);
+    uint32_t second = flatten(n->children[1], depth + 1);
+    nodes[index].offset = second;
+    nodes[index].occludeFirst = occludeFirst(n->children[0]->AABB, n->children[1]->AABB);
+
+    return index;
+}
+
+uint32_t BVH::flattenLeaf(const BoundingBox3f &bb, uint32_t first, uint32_t count, int depth)
+{
+    auto index = (uint32_t)nodes.size();
+    if (count <= MAX_LEAF_TRIS)
+    {
+        nodes.push_back({bb, first, (uint16_t)count, 0, 0});
+        return index;
+    }
+
+    if (depth >= STACK_SIZE - 1)
+        throw NoriException("BVH::flatten(): tree is too deep for the traversal stack!");
+
+    //Too many triangles for one node, so split the range in half (both halves share the bounds)
+    nodes.push_back({bb, 0, 0, 0, 0});
+    uint32_t half = count / 2;
+    flattenLeaf(bb, first, half, depth + 1);
+    uint32_t second = flattenLeaf(bb, first + half, count - half, depth + 1);
+    nodes[index].offset = second;
+
+    return index;
+}
+
 BVH::TriInd BVH::rayIntersect(const nori::Ray3f &ray_, nori::Intersection &its, bool shadowRay) const
 {
-    //Use the node tri intersect function on the whole octree
-    return nodeCloseTriIntersect(root, ray_, its, shadowRay);
+    if (leafTris.empty()) return {};
+
+    //Use the node tri intersect function on the whole BVH (shadow rays only need any hit)
+    if (shadowRay) return nodeCloseTriIntersect<true>(ray_, its);
+    return nodeCloseTriIntersect<false>(ray_, its);
 
 }
 
-BVH::TriInd BVH::leafRayTriIntersect(Node *n, nori::Ray3f &ray, nori::Intersection &its,
-                                           bool shadowRay) const
+template <bool shadowRay>
+BVH::TriInd BVH::leafRayTriIntersect(const LinearNode &n, nori::Ray3f &ray, nori::Intersection &its) const
 {
     TriInd f = {};      // Triangle index of the closest intersection
 
     /* Brute force search through all triangles */
-    for (auto idx : *(n->tris)) {
+    for (uint32_t i = n.offset; i < n.offset + n.triCount; ++i) {
+        const TriInd &idx = leafTris[i];
         float u, v, t;
-        if (meshes[idx.mesh]->rayIntersect(idx.i, ray, u, v, t)) {
+        if (leafTriIntersect(i, ray, u, v, t)) {
             /* An intersection was found! Can terminate
                immediately if this is a shadow ray query */
             if (shadowRay)
@@ -119,66 +860,335 @@ BVH::TriInd BVH::leafRayTriIntersect(Node *n, nori::Ray3f &ray, nori::Intersecti
     return f;
 }
 
-BVH::TriInd BVH::nodeCloseTriIntersect(Node *n, const nori::Ray3f &ray, nori::Intersection &its,
-                                             bool shadowRay) const
+template <bool shadowRay>
+BVH::TriInd BVH::nodeCloseTriIntersect(const nori::Ray3f &ray, nori::Intersection &its) const
 {
-    Node* stack[MAX_DEPTH + 1];
+    /// A node to visit (index into nodes), and where the ray enters its box
+    struct StackEntry
+    {
+        uint32_t node;
+        float tEnter;
+    };
+    StackEntry stack[STACK_SIZE];
     ///Stack index
-    int si = 0;
+    int si = -1;
 
     TriInd closeTri = {};
     Ray3f ray_(ray); /// Make a copy of the ray (we will need to update its '.maxt' value)
 
-    float close, far;
-    stack[0] = n;
+    //Returns whether the ray's current segment hits the box of nodes[n], and where it enters it
+    auto enters = [this, &ray_](uint32_t n, float& tEnter)
+    {
+        float tExit;
+        return nodes[n].AABB.rayIntersect(ray_, tEnter, tExit)
+               && tExit >= ray_.mint && tEnter <= ray_.maxt;
+    };
+
+    float tRoot;
+    if (enters(0, tRoot)) stack[++si] = {0, tRoot};
     while(si >= 0)
     {
-        Node* cur = stack[si];
+        StackEntry entry = stack[si];
         --si;
 
-        if(!cur->AABB.rayIntersect(ray_, close, far)) continue;
+        //Skip nodes that start beyond the closest hit found since they were pushed
+        if (entry.tEnter > ray_.maxt) continue;
+        const LinearNode& cur = nodes[entry.node];
 
-        if (cur->isLeaf())
-        { //Since this node is "first", it MUST be the closest
-            TriInd inter = leafRayTriIntersect(cur, ray_, its, shadowRay);
+        if (cur.isLeaf())
+        {
+            TriInd inter = leafRayTriIntersect<shadowRay>(cur, ray_, its);
             if(inter.isValid())
             {
                 closeTri = inter;
 #if QUICK_RETURN
                 return closeTri;
 #endif
+                //Any hit will do for a shadow ray
+                if (shadowRay) return closeTri;
+            }
+        }
+        else
+        {
+            ///Test both children (the first child directly follows cur), and push the one to
+            ///     visit first last: the one the ray enters first (or, for shadow rays, the one
+            ///     more likely to be hit)
+            uint32_t child[2] = {entry.node + 1, cur.offset};
+            float tEnter[2];
+            bool hit[2] = {enters(child[0], tEnter[0]), enters(child[1], tEnter[1])};
+            int first;
+            if (shadowRay) first = cur.occludeFirst;
+            else if (!hit[0] || !hit[1]) first = hit[1] ? 1 : 0;
+            else
+            {
+                //A box the ray starts in is entered at mint, whatever its slabs say, so such
+                //  ties (common with large, overlapping boxes) fall back to the ray's direction
+                float t0 = std::max(tEnter[0], ray_.mint), t1 = std::max(tEnter[1], ray_.mint);
+                first = t1 < t0 || (t1 == t0 && ray_.d[cur.dim] < 0) ? 1 : 0;
+            }
+            int second = 1 - first;
+
+            if (hit[second]) stack[++si] = {child[second], tEnter[second]};
+            if (hit[first]) stack[++si] = {child[first], tEnter[first]};
+        }
+
+    }
+
+    return closeTri;
+}
+
+/// A ray packet in SoA form, so that a box can be tested against 4 of its rays at once
+struct BVHPacket
+{
+    explicit BVHPacket(const RayPacket& packet)
+    {
+        for (int k = 0; k < RayPacket::MAX_SIZE; ++k)
+        {
+            //(Unused lanes are never part of a mask, they only need to be initialized)
+            const Ray3f& r = packet.rays[k < packet.size ? k : 0];
+            for (int a = 0; a < 3; ++a)
+            {
+                o[a][k] = r.o[a];
+                inv[a][k] = r.dRcp[a];
+            }
+            mint[k] = r.mint;
+            maxt[k] = r.maxt;
+        }
+    }
+
+    /// Tests the rays of mask against a box, clipped to their current [mint, maxt].
+    /// \return The rays of mask that hit the box
+    uint32_t intersect(const BoundingBox3f& bb, uint32_t mask) const
+    {
+        uint32_t hit = 0;
+        for (int g = 0; g < RayPacket::MAX_SIZE; g += 4)
+        {
+            if (((mask >> g) & 0xF) == 0) continue;
+#if BVH_SSE
+            __m128 tmin = _mm_load_ps(mint + g), tmax = _mm_load_ps(maxt + g);
+            for (int a = 0; a < 3; ++a)
+            {
+                __m128 oa = _mm_load_ps(o[a] + g), inva = _mm_load_ps(inv[a] + g);
+                __m128 lo = _mm_set1_ps(bb.min[a]), hi = _mm_set1_ps(bb.max[a]);
+                //The rays may point different ways, so pick the near/far planes per lane
+                //  (using the reciprocal, so that a direction of -0 counts as negative)
+                __m128 neg = _mm_cmplt_ps(inva, _mm_setzero_ps());
+                __m128 nearP = _mm_or_ps(_mm_and_ps(neg, hi), _mm_andnot_ps(neg, lo));
+                __m128 farP = _mm_or_ps(_mm_and_ps(neg, lo), _mm_andnot_ps(neg, hi));
+                //The running interval is the second operand, so NaNs (0 * inf, from a ray lying
+                //  in a slab's plane) leave it untouched
+                tmin = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearP, oa), inva), tmin);
+                tmax = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farP, oa), inva), tmax);
+            }
+            hit |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << g;
+#else
+            for (int k = g; k < g + 4; ++k)
+            {
+                float tmin = mint[k], tmax = maxt[k];
+                for (int a = 0; a < 3; ++a)
+                {
+                    bool neg = inv[a][k] < 0;
+                    float tNear = ((neg ? bb.max[a] : bb.min[a]) - o[a][k]) * inv[a][k];
+                    float tFar = ((neg ? bb.min[a] : bb.max[a]) - o[a][k]) * inv[a][k];
+                    tmin = tNear > tmin ? tNear : tmin;
+                    tmax = tFar < tmax ? tFar : tmax;
+                }
+                if (tmin <= tmax) hit |= 1u << k;
+            }
+#endif
+        }
+        return hit & mask;
+    }
+
+    alignas(16) float o[3][RayPacket::MAX_SIZE];
+    alignas(16) float inv[3][RayPacket::MAX_SIZE];
+    alignas(16) float mint[RayPacket::MAX_SIZE];
+    /// The current maxt of each ray (shrinks as closer hits are found)
+    alignas(16) float maxt[RayPacket::MAX_SIZE];
+};
+
+void BVH::rayIntersectPacket(const RayPacket &packet, nori::Intersection *its, TriInd *tris,
+                             bool shadowRay) const
+{
+    for (int k = 0; k < packet.size; ++k)
+    {
+        tris[k] = {};
+    }
+    if (leafTris.empty() || packet.size <= 0) return;
+
+    /// A stack entry: a node index, and the rays that hit its parent
+    struct Entry
+    {
+        uint32_t node;
+        uint32_t mask;
+    };
+    Entry stack[STACK_SIZE];
+    ///Stack index
+    int si = 0;
+
+    Ray3f rays[RayPacket::MAX_SIZE]; /// Copies of the rays (we will need to update their '.maxt' values)
+    for (int k = 0; k < packet.size; ++k)
+    {
+        rays[k] = packet.rays[k];
+    }
+    BVHPacket soa(packet);
+
+    ///The rays that still need traversing (shadow rays are done at their first hit)
+    uint32_t active = (1u << packet.size) - 1;
+
+    stack[0] = {0, active};
+    while(si >= 0)
+    {
+        Entry curE = stack[si];
+        const LinearNode& cur = nodes[curE.node];
+        --si;
+
+        uint32_t mask = soa.intersect(cur.AABB, curE.mask & active);
+        if (mask == 0) continue;
+
+        if (cur.isLeaf())
+        {
+            for (int k = 0; k < packet.size; ++k)
+            {
+                if (!(mask & (1u << k))) continue;
+
+                TriInd inter = shadowRay ? leafRayTriIntersect<true>(cur, rays[k], its[k])
+                                         : leafRayTriIntersect<false>(cur, rays[k], its[k]);
+                if(inter.isValid())
+                {
+                    tris[k] = inter;
+                    soa.maxt[k] = rays[k].maxt;
+                    if (shadowRay) active &= ~(1u << k);
+                }
             }
+            if (active == 0) return;
         }
         else
         {
-            ///Add the two child nodes in order
-            if(ray.d[cur->dim] >= 0)
+            ///Order the children by the direction of the first ray that hit this node
+            int first = 0;
+            while (!(mask & (1u << first))) ++first;
+
+            if(rays[first].d[cur.dim] >= 0)
             { //0 node closer theoretically
                 ++si;
-                stack[si] = cur->children[1];
+                stack[si] = {cur.offset, mask};
                 ++si;
-                stack[si] = cur->children[0];
+                stack[si] = {curE.node + 1, mask};
             }
             else
             {//1 node is closer
                 ++si;
-                stack[si] = cur->children[0];
+                stack[si] = {curE.node + 1, mask};
                 ++si;
-                stack[si] = cur->children[1];
+                stack[si] = {cur.offset, mask};
             }
-
         }
+    }
+}
 
+void BVH::rayIntersectBatch(const RayBatch &rays, nori::Intersection *its, TriInd *tris,
+                            bool shadowRay) const
+{
+    for (std::size_t k = 0; k < rays.size; ++k)
+    {
+        tris[k] = {};
     }
+    if (leafTris.empty()) return;
 
-    return closeTri;
+    /// A stack entry: a node index, and the rays that hit its parent (pool[begin, end))
+    struct Entry
+    {
+        uint32_t node;
+        uint32_t begin, end;
+    };
+    Entry stack[STACK_SIZE];
+
+    Intersection unused; /* Shadow ray queries don't need a record per ray */
+    std::vector<Ray3f> stream; /// Copies of the rays (we will need to update their '.maxt' values)
+    stream.reserve(STREAM_SIZE);
+    /// The ray lists of all nodes on the current path. A node's list is always appended
+    ///     past its parent's, so the pool never needs more than one list per level.
+    std::vector<uint32_t> pool((STACK_SIZE + 1) * STREAM_SIZE);
+
+    for (std::size_t base = 0; base < rays.size; base += STREAM_SIZE)
+    {
+        auto n = (uint32_t)std::min<std::size_t>(STREAM_SIZE, rays.size - base);
+        stream.clear();
+        for (uint32_t k = 0; k < n; ++k)
+        {
+            stream.push_back(rays.ray(base + k));
+            pool[k] = k;
+        }
+
+        ///Stack index
+        int si = 0;
+        stack[0] = {0, 0, n};
+        while(si >= 0)
+        {
+            Entry curE = stack[si];
+            const LinearNode& cur = nodes[curE.node];
+            --si;
+
+            //Filter the rays that reached this node through its box
+            //  (the sibling on the stack shares curE's list, so write past it)
+            uint32_t begin = curE.end, end = curE.end;
+            for (uint32_t i = curE.begin; i < curE.end; ++i)
+            {
+                uint32_t k = pool[i];
+                if (shadowRay && tris[base + k].isValid()) continue; //Already occluded
+                if (cur.AABB.rayIntersect(stream[k]))
+                {
+                    pool[end++] = k;
+                }
+            }
+            if (begin == end) continue;
+
+            if (cur.isLeaf())
+            {
+                for (uint32_t i = begin; i < end; ++i)
+                {
+                    uint32_t k = pool[i];
+                    Intersection& itsK = its ? its[base + k] : unused;
+                    TriInd inter = shadowRay ? leafRayTriIntersect<true>(cur, stream[k], itsK)
+                                             : leafRayTriIntersect<false>(cur, stream[k], itsK);
+                    if(inter.isValid())
+                    {
+                        tris[base + k] = inter;
+                    }
+                }
+            }
+            else
+            {
+                ///Order the children by the direction of the first ray of the list
+                if(stream[pool[begin]].d[cur.dim] >= 0)
+                { //0 node closer theoretically
+                    ++si;
+                    stack[si] = {cur.offset, begin, end};
+                    ++si;
+                    stack[si] = {curE.node + 1, begin, end};
+                }
+                else
+                {//1 node is closer
+                    ++si;
+                    stack[si] = {curE.node + 1, begin, end};
+                    ++si;
+                    stack[si] = {cur.offset, begin, end};
+                }
+            }
+        }
+    }
 }
 
-BVH::SplitData BVH::getGoodSplit(const BoundingBox3f &bb, std::vector<TriInd> *tris,
-                                 SplitMethod method) const
+BVH::SplitData BVH::getGoodSplit(const BoundingBox3f &bb, uint32_t start, uint32_t end,
+                                 SplitMethod method)
  {
+    ///The triangles of this node, and how many there are
+    TriInd* tris = leafTris.data() + start;
+    std::size_t triCt = end - start;
+
     if (method == SAHFull) {
-        float minSAH = TRI_INT_COST * tris->size() + 1;
+        float minSAH = TRI_INT_COST * triCt + 1;
         int bestD = -1;
         std::vector<TriInd> bestDCopy;
 
@@ -192,24 +1202,24 @@ BVH::SplitData BVH::getGoodSplit(const BoundingBox3f &bb, std::vector<TriInd> *t
         for (int d = 0; d < 3; ++d) {
 
             //Try with the min axis bounds
-            sortOnDim(tris, d);
+            sortOnDim(tris, triCt, d);
 
             ///All of the bounding boxes for the second node (first node can be computed on the fly)
-            std::vector<BoundingBox3f> backAABBs(tris->size() - 1);
-            backAABBs[tris->size() - 2] = getTriBB(
-                    (*tris)[tris->size() - 1]); //last bb should just be the single triangle
-            for (long i = (long)tris->size() - 3; i >= 0; --i) {
+            std::vector<BoundingBox3f> backAABBs(triCt - 1);
+            backAABBs[triCt - 2] = getTriBB(
+                    tris[triCt - 1]); //last bb should just be the single triangle
+            for (long i = (long)triCt - 3; i >= 0; --i) {
                 backAABBs[i] = backAABBs[i + 1];
-                backAABBs[i].expandBy(getTriBB((*tris)[i + 1]));
+                backAABBs[i].expandBy(getTriBB(tris[i + 1]));
             }
 
             BoundingBox3f curBB = {};
             float lCost = 0;
-            float hCost = tris->size() * TRI_INT_COST;
-            for (std::size_t i = 0; i < tris->size() - 1; ++i) {
+            float hCost = triCt * TRI_INT_COST;
+            for (std::size_t i = 0; i < triCt - 1; ++i) {
 
                 //Update/expand the BB!
-                TriInd t = (*tris)[i];
+                TriInd t = tris[i];
                 curBB.expandBy(getTriBB(t));
 
                 lCost += TRI_INT_COST;
@@ -225,7 +1235,7 @@ BVH::SplitData BVH::getGoodSplit(const BoundingBox3f &bb, std::vector<TriInd> *t
                     if (bestD != d) {
                         bestD = d;
                         if (d != 2)
-                            bestDCopy = *tris;
+                            bestDCopy.assign(tris, tris + triCt);
                     }
                     bestI = i;
                     bestBB1 = curBB;
@@ -237,22 +1247,16 @@ BVH::SplitData BVH::getGoodSplit(const BoundingBox3f &bb, std::vector<TriInd> *t
         }
 
         //If the SAH isnt better than just no split, then dont split (invalid split return)
-        if (minSAH < TRI_INT_COST * tris->size()) {
+        if (minSAH < TRI_INT_COST * triCt) {
             bestI++;
 
-            std::vector<TriInd> *tris1, *tris2;
             if (bestD != 2)
-            { //used the copied dimension vector
-                tris1 = new std::vector<TriInd>(bestDCopy.begin(), bestDCopy.begin()+bestI);
-                tris2 = new std::vector<TriInd>(bestDCopy.begin()+bestI, bestDCopy.end());
-            }
-            else
-            {//use the currently sorted dimension vector
-                tris1 = new std::vector<TriInd>(tris->begin(), tris->begin()+bestI);
-                tris2 = new std::vector<TriInd>(tris->begin()+bestI, tris->end());
+            { //restore the order of the copied dimension
+                std::copy(bestDCopy.begin(), bestDCopy.end(), tris);
             }
+            //(otherwise the range is still sorted on the best dimension)
 
-            return {bestI, bestD, bestBB1, bestBB2, tris1, tris2};
+            return {bestI, bestD, bestBB1, bestBB2};
         } else {
             return {};
         }
@@ -260,36 +1264,11 @@ BVH::SplitData BVH::getGoodSplit(const BoundingBox3f &bb, std::vector<TriInd> *t
 
     else if (method == SAHBuckets)
     {
-        //1. Create and collect vertices in buckets
-        std::vector<std::vector<TriInd>> dimBuckets[3]
-                {std::vector<std::vector<TriInd>>(BUCKETS),
-                 std::vector<std::vector<TriInd>>(BUCKETS),
-                 std::vector<std::vector<TriInd>>(BUCKETS)};
-        BoundingBox3f dimBBox[3][BUCKETS];
-        for(auto & i : dimBBox)
-        {
-            for(auto & b : i)
-            {
-                b = {};
-            }
-        }
-
-        Vector3f sz = bb.max-bb.min;
-		
-        for(auto t: *tris)
-        {
-            Vector3f pt = meshes[t.mesh]->getCentroid(t.i);
-            Vector3f relPt = BUCKETS*(pt - bb.min) ;
-            for(int d = 0; d < 3; ++d)
-            {
-                int ind = (int)(relPt[d]/sz[d]);
-                dimBuckets[d][ind].push_back(t);
-                dimBBox[d][ind].expandBy(getTriBB(t));
-            }
-        }
+        //1. Count and bound the triangles in each bucket
+        Bins bins = binTris(bb, start, end);
 
         //2. SAH :)
-        float minSAH = TRI_INT_COST * tris->size() + 1;
+        float minSAH = TRI_INT_COST * triCt + 1;
 
         int bestD = 0;
         std::size_t bestI = 0;
@@ -301,33 +1280,35 @@ BVH::SplitData BVH::getGoodSplit(const BoundingBox3f &bb, std::vector<TriInd> *t
 
         //Dimension loop
         for (int d = 0; d < 3; ++d) {
+            const Bucket* dimBuckets = bins.buckets[d];
 
             ///All of the bounding boxes for the second node (first node can be computed on the fly)
-            std::vector<BoundingBox3f> backAABBs(BUCKETS-1);
+            BoundingBox3f backAABBs[BUCKETS-1];
             //last bb should just be the single bucket
-            backAABBs[BUCKETS-2] = dimBBox[d][BUCKETS-1];
+            backAABBs[BUCKETS-2] = dimBuckets[BUCKETS-1].bb;
             for (int i = BUCKETS - 3; i >= 0; --i) {
                 backAABBs[i] = backAABBs[i + 1];
-                backAABBs[i].expandBy(dimBBox[d][i+1]);
+                backAABBs[i].expandBy(dimBuckets[i+1].bb);
             }
 
             BoundingBox3f curBB = {};
-            int lCost = 0;
-            int hCost = tris->size();
+            std::size_t lCost = 0;
+            std::size_t hCost = triCt;
             for (std::size_t i = 0; i < BUCKETS - 1; ++i) {
 
                 //Update/expand the BB!
-                curBB.expandBy(dimBBox[d][i]);
+                curBB.expandBy(dimBuckets[i].bb);
 
-                lCost += dimBuckets[d][i].size();
-                hCost -= dimBuckets[d][i].size();
+                lCost += dimBuckets[i].count;
+                hCost -= dimBuckets[i].count;
+
+                //(A split with an empty side is no split at all)
+                if (lCost == 0 || hCost == 0) continue;
 
                 float sah = TRAVERSAL_TIME + TRI_INT_COST*(curBB.getSurfaceArea() * (float)lCost +
                                               backAABBs[i].getSurfaceArea() * (float)hCost) / bbSA;
 
                 if (sah <= minSAH) {
-                    //std::cout << "Dim " << d << ", lCost " << lCost << ", hCost " << hCost << ", totTriCost " << totTriCost << ", SAH " << sah << std::endl;
-                    //std::cout << "BBSA " << bbSA << ", cur " << curBB.getSurfaceArea() << ", back " << backAABBs[i].getSurfaceArea() << ", totTriCost " << totTriCost << ", SAH " << sah << std::endl;
                     minSAH = sah;
                     bestD = d;
                     bestI = i;
@@ -341,29 +1322,13 @@ BVH::SplitData BVH::getGoodSplit(const BoundingBox3f &bb, std::vector<TriInd> *t
         }
 
         //If the SAH isnt better than just no split, then dont split (invalid split return)
-        if (minSAH < TRI_INT_COST * tris->size()) {
-            bestI++;
-            auto tris1 = new std::vector<TriInd>;
-            tris1->reserve(bestTriCt);
-            auto tris2 = new std::vector<TriInd>;
-            tris2->reserve(tris->size() - bestTriCt);
-
-            for(std::size_t b = 0; b < bestI; b++)
-            {
-                for(auto t: dimBuckets[bestD][b])
-                {
-                    tris1->push_back(t);
-                }
-            }
-            for(std::size_t b = bestI; b < BUCKETS; b++)
-            {
-                for(auto t: dimBuckets[bestD][b])
-                {
-                    tris2->push_back(t);
-                }
-            }
+        if (minSAH < TRI_INT_COST * triCt) {
+            //Partition the range in place, so the first child's triangles (buckets [0, bestI]) come first
+            std::partition(tris, tris + triCt, [&](const TriInd &t) {
+                return bucketIndex(bb, meshes[t.mesh]->getCentroid(t.i), bestD) <= (int)bestI;
+            });
 
-            return {bestTriCt, bestD, bestBB1, bestBB2, tris1, tris2};
+            return {bestTriCt, bestD, bestBB1, bestBB2};
         } else {
             return {};
         }
@@ -377,8 +1342,62 @@ BVH::SplitData BVH::getGoodSplit(const BoundingBox3f &bb, std::vector<TriInd> *t
 
 }
 
-void BVH::sortOnDim(std::vector<TriInd> *tris, int d) const{
-    std::sort(tris->begin(), tris->end(), [d, this](const TriInd &a, const TriInd &b) {
+void BVH::Bins::merge(const Bins &other)
+{
+    for (int d = 0; d < 3; ++d)
+    {
+        for (std::size_t b = 0; b < BUCKETS; ++b)
+        {
+            buckets[d][b].count += other.buckets[d][b].count;
+            buckets[d][b].bb.expandBy(other.buckets[d][b].bb);
+        }
+    }
+}
+
+uint8_t BVH::occludeFirst(const BoundingBox3f &a, const BoundingBox3f &b)
+{
+    return b.getSurfaceArea() > a.getSurfaceArea() ? 1 : 0;
+}
+
+int BVH::bucketIndex(const BoundingBox3f &bb, const Point3f &centroid, int d)
+{
+    float sz = bb.max[d] - bb.min[d];
+    if (!(sz > 0)) return 0; //Flat node, so every triangle shares one bucket
+
+    //(Clamped, since a centroid on the max face would land one past the last bucket)
+    auto ind = (int)(BUCKETS * (centroid[d] - bb.min[d]) / sz);
+    return std::min(std::max(ind, 0), (int)BUCKETS - 1);
+}
+
+BVH::Bins BVH::binTris(const BoundingBox3f &bb, uint32_t start, uint32_t end) const
+{
+    auto binRange = [&](const tbb::blocked_range<uint32_t> &r, Bins bins) {
+        for (uint32_t ti = r.begin(); ti < r.end(); ++ti)
+        {
+            const TriInd &t = leafTris[ti];
+            Point3f c = meshes[t.mesh]->getCentroid(t.i);
+            BoundingBox3f triBB = getTriBB(t);
+            for (int d = 0; d < 3; ++d)
+            {
+                bins.add(d, bucketIndex(bb, c, d), triBB);
+            }
+        }
+        return bins;
+    };
+
+    tbb::blocked_range<uint32_t> range(start, end, PARALLEL_BIN_TRIS / 4);
+#if BVH_PARALLEL
+    if (end - start >= PARALLEL_BIN_TRIS)
+    {
+        return tbb::parallel_reduce(range, Bins(), binRange,
+                                    [](Bins a, const Bins &b) { a.merge(b); return a; });
+    }
+#endif
+    return binRange(range, Bins());
+}
+
+void BVH::sortOnDim(TriInd *tris, std::size_t n, int d) const{
+    std::sort(tris, tris + n, [d, this](const TriInd &a, const TriInd &b) {
         return this->meshes[a.mesh]->getCentroid(a.i)[d] <
                 this->meshes[b.mesh]->getCentroid(b.i)[d];
     });
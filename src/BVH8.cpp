@@ -0,0 +1,400 @@
+//
+// An 8-wide BVH with AVX2 kernels, collapsed from the binary SAH BVH.
+//
+
+#include "nori/BVH8.h"
+
+#include <chrono>
+
+//Whether the AVX2 kernels can be compiled (they are only used if the CPU supports them)
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BVH8_AVX2 true
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+//MSVC allows AVX2 intrinsics in any function
+#define BVH8_AVX2_TARGET
+#else
+//Compile only the kernels themselves for AVX2, so the rest of the binary runs on any x86 CPU
+#define BVH8_AVX2_TARGET __attribute__((target("avx2,fma")))
+#endif
+#else
+#define BVH8_AVX2 false
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+BVH8::Node::Node()
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        setBounds(i, BoundingBox3f());
+        child[i] = 0;
+        blockCount[i] = 0;
+    }
+    for (auto & p : pad) p = 0;
+}
+
+void BVH8::Node::setBounds(int i, const BoundingBox3f &bb)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        bounds[0][a][i] = bb.min[a];
+        bounds[1][a][i] = bb.max[a];
+    }
+}
+
+bool BVH8::cpuSupportsAVX2()
+{
+#if BVH8_AVX2
+    static const bool supported = []
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) return false;
+        __cpuid(info, 1);
+        bool fma = (info[2] & (1 << 12)) != 0;
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        //The OS must also save the AVX registers
+        if (!fma || !osxsave || (_xgetbv(0) & 6) != 6) return false;
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    }();
+    return supported;
+#else
+    return false;
+#endif
+}
+
+void BVH8::build() {
+    if(built) return;
+    built = true;
+
+    if (!cpuSupportsAVX2())
+    { //Use the SSE kernel instead
+        std::cout << "BVH8: AVX2 is not supported by this CPU, falling back to the SSE QBVH" << std::endl;
+        fallback = new QBVH(m_method, m_optimizeTreelets);
+        fallback->setPrecomputeTris(precomputeTris);
+        for (auto mesh: meshes)
+        {
+            fallback->addMesh(mesh);
+        }
+        fallback->build();
+        return;
+    }
+
+    //Build the binary BVH over the same meshes
+    BVH bvh(m_method, m_optimizeTreelets);
+    for (auto mesh: meshes)
+    {
+        bvh.addMesh(mesh);
+    }
+    bvh.build();
+
+    //Collapse (& time) it into the BVH8
+    auto startT = std::chrono::high_resolution_clock::now();
+    nodes.clear();
+    blocks.clear();
+    leafTris.swap(bvh.leafTris);
+    const std::vector<BVH::LinearNode>& bin = bvh.nodes;
+    if (!leafTris.empty())
+    {
+        blocks.reserve(leafTris.size() / 4);
+        if (bin[0].isLeaf())
+        { //A single leaf, so the root only has one child
+            Node root;
+            root.setBounds(0, bin[0].AABB);
+            root.child[0] = addBlocks(bin[0]);
+            root.blockCount[0] = (uint16_t)(blocks.size() - root.child[0]);
+            nodes.push_back(root);
+        }
+        else
+        {
+            collapse(bin, 0);
+        }
+    }
+    auto endT = std::chrono::high_resolution_clock::now();
+    auto durT = std::chrono::duration_cast<std::chrono::milliseconds>(endT-startT);
+
+    //Print some information
+    std::cout << "Acceleration Structure: BVH8 (AVX2)" << std::endl;
+    std::cout << "Nodes: " << nodes.size() << ", Tree Stored Tris: " << leafTris.size()
+              << ", Triangle Blocks: " << blocks.size() << std::endl;
+    std::cout << "Node Memory: " << memString(nodes.size() * sizeof(Node))
+              << ", Triangle Block Memory: " << memString(blocks.size() * sizeof(TriBlock)) << std::endl;
+    std::cout << "BVH8 Collapse Time: " << durT.count() << " MS" << endl;
+}
+
+uint32_t BVH8::collapse(const std::vector<BVH::LinearNode> &bin, uint32_t n)
+{
+    auto index = (uint32_t)nodes.size();
+    nodes.emplace_back();
+
+    //Start with the two children of n, and keep opening the inner child with the
+    //  largest surface area (the one most likely to be hit) until there are 8
+    uint32_t slots[8]{n + 1, bin[n].offset};
+    int used = 2;
+    while (used < 8)
+    {
+        int best = -1;
+        float bestSA = -1;
+        for (int i = 0; i < used; ++i)
+        {
+            const BVH::LinearNode& c = bin[slots[i]];
+            if (!c.isLeaf() && c.AABB.getSurfaceArea() > bestSA)
+            {
+                best = i;
+                bestSA = c.AABB.getSurfaceArea();
+            }
+        }
+        if (best == -1) break;
+
+        uint32_t opened = slots[best];
+        slots[best] = opened + 1;
+        slots[used] = bin[opened].offset;
+        ++used;
+    }
+
+    Node node;
+    for (int i = 0; i < used; ++i)
+    {
+        const BVH::LinearNode& c = bin[slots[i]];
+        node.setBounds(i, c.AABB);
+        if (c.isLeaf())
+        {
+            node.child[i] = addBlocks(c);
+            node.blockCount[i] = (uint16_t)(blocks.size() - node.child[i]);
+        }
+        else
+        {
+            node.child[i] = collapse(bin, slots[i]);
+        }
+    }
+
+    //(nodes may have been reallocated by the recursion)
+    nodes[index] = node;
+    return index;
+}
+
+uint32_t BVH8::addBlocks(const BVH::LinearNode &leaf)
+{
+    auto first = (uint32_t)blocks.size();
+    for (uint32_t b = 0; b < leaf.triCount; b += 8)
+    {
+        TriBlock block;
+        for (uint32_t l = 0; l < 8; ++l)
+        {
+            TriAccel tri;
+            if (b + l < leaf.triCount)
+            {
+                uint32_t ref = leaf.offset + b + l;
+                tri = TriAccel(meshes[leafTris[ref].mesh], leafTris[ref].i);
+                block.ref[l] = ref;
+            }
+            else
+            { //Degenerate (zero area) triangle, which can never be hit
+                tri.p0 = tri.edge1 = tri.edge2 = Vector3f(0.f);
+                block.ref[l] = leaf.offset;
+            }
+            for (int a = 0; a < 3; ++a)
+            {
+                block.p0[a][l] = tri.p0[a];
+                block.edge1[a][l] = tri.edge1[a];
+                block.edge2[a][l] = tri.edge2[a];
+            }
+        }
+        blocks.push_back(block);
+    }
+    return first;
+}
+
+BVH8::TriInd BVH8::rayIntersect(const nori::Ray3f &ray_, nori::Intersection &its, bool shadowRay) const
+{
+    if (fallback) return fallback->rayIntersect(ray_, its, shadowRay);
+    if (nodes.empty()) return {};
+
+    return rayIntersectAVX2(ray_, its, shadowRay);
+}
+
+#if BVH8_AVX2
+
+BVH8_AVX2_TARGET
+BVH8::TriInd BVH8::rayIntersectAVX2(const nori::Ray3f &ray_, nori::Intersection &its, bool shadowRay) const
+{
+    /// A stack entry: a node index, or a leaf's TriBlock range (count > 0)
+    struct Entry
+    {
+        uint32_t child;
+        uint32_t count;
+    };
+    Entry stack[STACK_SIZE];
+    ///Stack index
+    int si = 0;
+
+    TriInd closeTri = {};
+    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+
+    //Splat the ray for the 8-wide tests. sign = 1 if the near plane is the box max
+    int sign[3];
+    __m256 o[3], d[3], inv[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        //(Use the reciprocal, so that a direction of -0 counts as negative)
+        sign[a] = ray.dRcp[a] < 0 ? 1 : 0;
+        o[a] = _mm256_set1_ps(ray.o[a]);
+        d[a] = _mm256_set1_ps(ray.d[a]);
+        inv[a] = _mm256_set1_ps(ray.dRcp[a]);
+    }
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    const __m256 eps = _mm256_set1_ps(1e-8f), negEps = _mm256_set1_ps(-1e-8f);
+    const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+
+    stack[0] = {0, 0};
+    while(si >= 0)
+    {
+        Entry cur = stack[si];
+        --si;
+
+        if (cur.count > 0)
+        { //Leaf: test 8 triangles at a time (Moeller-Trumbore, as in Mesh::rayIntersect)
+            __m256 mint = _mm256_set1_ps(ray.mint);
+            for (uint32_t b = cur.child; b < cur.child + cur.count; ++b)
+            {
+                const TriBlock& tb = blocks[b];
+                __m256 e1[3], e2[3], p0[3];
+                for (int a = 0; a < 3; ++a)
+                {
+                    e1[a] = _mm256_loadu_ps(tb.edge1[a]);
+                    e2[a] = _mm256_loadu_ps(tb.edge2[a]);
+                    p0[a] = _mm256_loadu_ps(tb.p0[a]);
+                }
+
+                //pvec = d x edge2
+                __m256 px = _mm256_sub_ps(_mm256_mul_ps(d[1], e2[2]), _mm256_mul_ps(d[2], e2[1]));
+                __m256 py = _mm256_sub_ps(_mm256_mul_ps(d[2], e2[0]), _mm256_mul_ps(d[0], e2[2]));
+                __m256 pz = _mm256_sub_ps(_mm256_mul_ps(d[0], e2[1]), _mm256_mul_ps(d[1], e2[0]));
+
+                __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1[0], px), _mm256_mul_ps(e1[1], py)),
+                                           _mm256_mul_ps(e1[2], pz));
+                __m256 valid = _mm256_or_ps(_mm256_cmp_ps(det, negEps, _CMP_LE_OQ),
+                                            _mm256_cmp_ps(det, eps, _CMP_GE_OQ));
+                if (_mm256_movemask_ps(valid) == 0) continue;
+                __m256 invDet = _mm256_div_ps(one, det);
+
+                //tvec = o - p0
+                __m256 tx = _mm256_sub_ps(o[0], p0[0]);
+                __m256 ty = _mm256_sub_ps(o[1], p0[1]);
+                __m256 tz = _mm256_sub_ps(o[2], p0[2]);
+
+                __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)),
+                                                       _mm256_mul_ps(tz, pz)), invDet);
+                valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ),
+                                                           _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+
+                //qvec = tvec x edge1
+                __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1[2]), _mm256_mul_ps(tz, e1[1]));
+                __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1[0]), _mm256_mul_ps(tx, e1[2]));
+                __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1[1]), _mm256_mul_ps(ty, e1[0]));
+
+                __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d[0], qx), _mm256_mul_ps(d[1], qy)),
+                                                       _mm256_mul_ps(d[2], qz)), invDet);
+                valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ),
+                                                           _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+
+                __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2[0], qx), _mm256_mul_ps(e2[1], qy)),
+                                                       _mm256_mul_ps(e2[2], qz)), invDet);
+                valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, mint, _CMP_GE_OQ),
+                                                           _mm256_cmp_ps(t, _mm256_set1_ps(ray.maxt), _CMP_LE_OQ)));
+
+                int hitMask = _mm256_movemask_ps(valid);
+                if (hitMask == 0) continue;
+
+                /* An intersection was found! Can terminate
+                   immediately if this is a shadow ray query */
+                if (shadowRay)
+                {
+                    int lane = 0;
+                    while (!(hitMask & (1 << lane))) ++lane;
+                    return leafTris[tb.ref[lane]];
+                }
+
+                //Find the closest of the hit lanes
+                float ts[8], us[8], vs[8];
+                _mm256_storeu_ps(ts, _mm256_blendv_ps(inf, t, valid));
+                _mm256_storeu_ps(us, u);
+                _mm256_storeu_ps(vs, v);
+                int lane = -1;
+                for (int l = 0; l < 8; ++l)
+                {
+                    if ((hitMask & (1 << l)) && (lane == -1 || ts[l] < ts[lane])) lane = l;
+                }
+
+                const TriInd &idx = leafTris[tb.ref[lane]];
+                ray.maxt = its.t = ts[lane];
+                its.uv = Point2f(us[lane], vs[lane]);
+                its.mesh = meshes[idx.mesh];
+                closeTri = idx;
+            }
+            continue;
+        }
+
+        //Inner node: test all 8 child boxes at once
+        const Node& n = nodes[cur.child];
+        __m256 tmin = _mm256_set1_ps(ray.mint), tmax = _mm256_set1_ps(ray.maxt);
+        for (int a = 0; a < 3; ++a)
+        {
+            __m256 tNear = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(n.bounds[sign[a]][a]), o[a]), inv[a]);
+            __m256 tFar = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(n.bounds[1 - sign[a]][a]), o[a]), inv[a]);
+            //The running interval is the second operand, so NaNs (0 * inf, from a ray lying
+            //  in a slab's plane) leave it untouched
+            tmin = _mm256_max_ps(tNear, tmin);
+            tmax = _mm256_min_ps(tFar, tmax);
+        }
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+        if (mask == 0) continue;
+
+        //Order the hit children by their entry distance, farthest first
+        float dists[8];
+        _mm256_storeu_ps(dists, tmin);
+        int order[8];
+        int hits = 0;
+        for (int c = 0; c < 8; ++c)
+        {
+            if (!(mask & (1 << c))) continue;
+            int k = hits++;
+            while (k > 0 && dists[order[k - 1]] < dists[c])
+            {
+                order[k] = order[k - 1];
+                --k;
+            }
+            order[k] = c;
+        }
+
+        //Push farthest first, so the nearest child is popped first
+        for (int k = 0; k < hits; ++k)
+        {
+            int c = order[k];
+            ++si;
+            stack[si] = {n.child[c], n.blockCount[c]};
+        }
+    }
+
+    return closeTri;
+}
+
+#else
+
+BVH8::TriInd BVH8::rayIntersectAVX2(const nori::Ray3f &ray_, nori::Intersection &its, bool shadowRay) const
+{
+    //Never called, since cpuSupportsAVX2() is always false here
+    return {};
+}
+
+#endif
+
+NORI_NAMESPACE_END
@@ -0,0 +1,354 @@
+//
+// A uniform grid (or a two-level grid, whose dense cells hold grids of their own) traversed
+//     with a 3D-DDA.
+//
+
+#include "nori/Grid.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <tbb/parallel_for.h>
+
+NORI_NAMESPACE_BEGIN
+
+static_assert(sizeof(Grid::Cell) == 8, "Grid cells should stay 8 bytes");
+
+void Grid::build()
+{
+    if(built) return;
+    built = true;
+
+    //Build (& time) the grid
+    auto startT = std::chrono::high_resolution_clock::now();
+    buildGrid();
+    auto endT = std::chrono::high_resolution_clock::now();
+    auto durT = std::chrono::duration_cast<std::chrono::milliseconds>(endT-startT);
+
+    uint32_t triCt = 0;
+    for(auto mesh: meshes)
+    {
+        triCt += mesh->getTriangleCount();
+    }
+
+    //Print some information
+    std::cout << "Acceleration Structure: " << (m_twoLevel ? "Two-Level Grid" : "Grid") << std::endl;
+    if (!grids.empty())
+    {
+        std::cout << "Resolution: " << grids[0].res[0] << "x" << grids[0].res[1] << "x" << grids[0].res[2]
+                  << ", Sub-Grids: " << grids.size() - 1 << std::endl;
+    }
+    std::cout << "Cells: " << cells.size() << ", Tree Stored Tris: " << leafTris.size() << ", Mesh Tris: " << triCt << std::endl;
+    std::cout << "Cell Memory: " << memString(cells.size() * sizeof(Cell)) << std::endl;
+    std::cout << "Grid Construction Time: " << durT.count() << " MS" << endl;
+
+    //Store the triangles themselves in cell order, if enabled
+    buildTriAccels();
+}
+
+void Grid::refit()
+{
+    if (!built) return;
+
+    bbox.reset();
+    for (auto mesh: meshes)
+    {
+        bbox.expandBy(mesh->getBoundingBox());
+    }
+
+    buildGrid();
+    buildTriAccels();
+}
+
+void Grid::buildGrid()
+{
+    grids.clear();
+    cells.clear();
+    leafTris.clear();
+
+    //Collect all triangles
+    std::vector<TriInd> tris;
+    for(std::size_t i = 0; i < meshes.size(); ++i)
+    {
+        for(uint32_t t = 0; t < meshes[i]->getTriangleCount(); ++t)
+        {
+            tris.emplace_back(i, t);
+        }
+    }
+    if (tris.empty()) return;
+
+    Level top = makeLevel(bbox, tris.size(), m_twoLevel ? TOP_DENSITY : DENSITY);
+    top.firstCell = 0;
+    std::vector<Cell> topCells;
+    std::vector<TriInd> topTris;
+    fillLevel(top, tris, topCells, topTris);
+    grids.push_back(top);
+
+    if (!m_twoLevel)
+    {
+        cells = std::move(topCells);
+        leafTris = std::move(topTris);
+        return;
+    }
+
+    //Give every dense cell a grid of its own (over only its triangles)
+    std::vector<uint32_t> dense;
+    for (uint32_t k = 0; k < topCells.size(); ++k)
+    {
+        if (topCells[k].count > SUBGRID_TRIS) dense.push_back(k);
+    }
+
+    struct SubGrid
+    {
+        Level level;
+        std::vector<Cell> cells;
+        std::vector<TriInd> tris;
+    };
+    std::vector<SubGrid> subs(dense.size());
+    tbb::parallel_for(std::size_t(0), dense.size(),
+                      [&](std::size_t s)
+                      {
+                          uint32_t k = dense[s];
+                          int x = (int)(k % top.res[0]);
+                          int y = (int)(k / top.res[0] % top.res[1]);
+                          int z = (int)(k / top.res[0] / top.res[1]);
+                          const Cell& c = topCells[k];
+                          std::vector<TriInd> cellTris(topTris.begin() + c.first,
+                                                       topTris.begin() + c.first + c.count);
+                          subs[s].level = makeLevel(cellBB(top, x, y, z), cellTris.size(), DENSITY);
+                          fillLevel(subs[s].level, cellTris, subs[s].cells, subs[s].tris);
+                      });
+
+    //Store the top level's cells, then each sub-grid's cells, with all of their triangles
+    cells.resize(topCells.size());
+    std::size_t s = 0;
+    for (uint32_t k = 0; k < topCells.size(); ++k)
+    {
+        if (s < dense.size() && dense[s] == k)
+        {
+            SubGrid& sub = subs[s++];
+            auto first = (uint32_t)leafTris.size();
+            sub.level.firstCell = (uint32_t)cells.size();
+            cells[k] = {(uint32_t)grids.size(), Cell::SUBGRID};
+            grids.push_back(sub.level);
+            for (const Cell& c : sub.cells)
+            {
+                cells.push_back({first + c.first, c.count});
+            }
+            leafTris.insert(leafTris.end(), sub.tris.begin(), sub.tris.end());
+        }
+        else
+        {
+            const Cell& c = topCells[k];
+            cells[k] = {(uint32_t)leafTris.size(), c.count};
+            leafTris.insert(leafTris.end(), topTris.begin() + c.first, topTris.begin() + c.first + c.count);
+        }
+    }
+}
+
+Grid::Level Grid::makeLevel(const BoundingBox3f &bb, std::size_t triCount, float density)
+{
+    Level level;
+    level.AABB = bb;
+    level.firstCell = 0;
+
+    Vector3f ext = bb.getExtents();
+    float maxExt = ext.maxCoeff();
+    //(Flat boxes are given a little thickness, so their volume is not 0)
+    Vector3f e = ext.cwiseMax(Vector3f::Constant(maxExt * 1e-3f));
+    float cellsPerUnit = maxExt > 0 ? std::cbrt(density * (float)triCount / (e.x() * e.y() * e.z())) : 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        level.res[i] = clamp((int)(e[i] * cellsPerUnit), 1, (int)MAX_RES);
+        level.cellSize[i] = ext[i] / (float)level.res[i];
+        level.invCellSize[i] = ext[i] > 0 ? (float)level.res[i] / ext[i] : 0;
+    }
+    return level;
+}
+
+BoundingBox3f Grid::cellBB(const Level &level, int x, int y, int z)
+{
+    Vector3f lo = level.AABB.min + Vector3f((float)x, (float)y, (float)z).cwiseProduct(level.cellSize);
+    BoundingBox3f bb(lo, lo + level.cellSize);
+    //The last cells end exactly at the grid's bounds
+    if (x == level.res[0] - 1) bb.max.x() = level.AABB.max.x();
+    if (y == level.res[1] - 1) bb.max.y() = level.AABB.max.y();
+    if (z == level.res[2] - 1) bb.max.z() = level.AABB.max.z();
+    return bb;
+}
+
+bool Grid::triInCell(const TriInd &tri, const Vector3f &n, float d, const BoundingBox3f &cell) const
+{
+    //Most cells in the bounds of a large (or long, diagonal) triangle lie entirely off its plane
+    Vector3f center = cell.getCenter(), half = 0.5f * cell.getExtents();
+    float r = half.dot(n.cwiseAbs());
+    if (std::abs(n.dot(center) - d) > r * 1.001f + 1e-6f * std::abs(d)) return false;
+
+    return clippedTriBB(tri, cell).isValid();
+}
+
+void Grid::fillLevel(const Level &level, const std::vector<TriInd> &tris,
+                     std::vector<Cell> &cells, std::vector<TriInd> &cellTris) const
+{
+    std::size_t cellCt = (std::size_t)level.res[0] * level.res[1] * level.res[2];
+
+    //Calls f(cell index) for every cell of the level that tri overlaps
+    auto forCells = [&](const TriInd& tri, auto&& f)
+    {
+        BoundingBox3f triBB = meshes[tri.mesh]->getBoundingBox(tri.i);
+        int lo[3], hi[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            lo[i] = clamp((int)((triBB.min[i] - level.AABB.min[i]) * level.invCellSize[i]), 0, level.res[i] - 1);
+            hi[i] = clamp((int)((triBB.max[i] - level.AABB.min[i]) * level.invCellSize[i]), 0, level.res[i] - 1);
+        }
+        //A triangle within a single cell needs no further tests
+        bool single = lo[0] == hi[0] && lo[1] == hi[1] && lo[2] == hi[2];
+        Vector3f n;
+        float d = 0;
+        if (!single)
+        {
+            const MatrixXf &V = meshes[tri.mesh]->getVertexPositions();
+            const MatrixXu &F = meshes[tri.mesh]->getIndices();
+            Point3f p0 = V.col(F(0, tri.i)), p1 = V.col(F(1, tri.i)), p2 = V.col(F(2, tri.i));
+            n = (p1 - p0).cross(p2 - p0);
+            d = n.dot(p0);
+        }
+
+        for (int z = lo[2]; z <= hi[2]; ++z)
+        {
+            for (int y = lo[1]; y <= hi[1]; ++y)
+            {
+                for (int x = lo[0]; x <= hi[0]; ++x)
+                {
+                    if (single || triInCell(tri, n, d, cellBB(level, x, y, z)))
+                        f(((std::size_t)z * level.res[1] + y) * level.res[0] + x);
+                }
+            }
+        }
+    };
+
+    //1. Count the triangles of every cell
+    std::unique_ptr<std::atomic<uint32_t>[]> counts(new std::atomic<uint32_t>[cellCt]);
+    for (std::size_t k = 0; k < cellCt; ++k)
+    {
+        counts[k] = 0;
+    }
+    tbb::parallel_for(std::size_t(0), tris.size(),
+                      [&](std::size_t t)
+                      {
+                          forCells(tris[t], [&](std::size_t k) { ++counts[k]; });
+                      });
+
+    //2. Give each cell its range (then count up from its start, to scatter into it)
+    cells.resize(cellCt);
+    uint32_t total = 0;
+    for (std::size_t k = 0; k < cellCt; ++k)
+    {
+        cells[k] = {total, counts[k]};
+        counts[k] = total;
+        total += cells[k].count;
+    }
+
+    //3. Scatter the triangles into their cells
+    cellTris.resize(total);
+    tbb::parallel_for(std::size_t(0), tris.size(),
+                      [&](std::size_t t)
+                      {
+                          forCells(tris[t], [&](std::size_t k) { cellTris[counts[k]++] = tris[t]; });
+                      });
+}
+
+Grid::TriInd Grid::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const
+{
+    if (cells.empty()) return {};
+
+    float tEnter, tExit;
+    if (!bbox.rayIntersect(ray_, tEnter, tExit)) return {};
+    tEnter = std::max(tEnter, ray_.mint);
+    tExit = std::min(tExit, ray_.maxt);
+    if (tEnter > tExit) return {};
+
+    TriInd closeTri = {};
+    Ray3f ray(ray_); /// Shortened to the closest hit so far
+    traverse(0, ray, tEnter, tExit, its, shadowRay, closeTri);
+    return closeTri;
+}
+
+bool Grid::traverse(uint32_t level, Ray3f &ray, float tEnter, float tExit, Intersection &its,
+                    bool shadowRay, TriInd &closeTri) const
+{
+    const Level& g = grids[level];
+
+    //Start in the cell the ray enters the grid in, and find where it crosses the next cell
+    //  boundary along each axis (tNext), and how far apart those boundaries are (tDelta)
+    Point3f p = ray(tEnter);
+    int cell[3], step[3], out[3];
+    float tNext[3], tDelta[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        cell[i] = clamp((int)((p[i] - g.AABB.min[i]) * g.invCellSize[i]), 0, g.res[i] - 1);
+        if (ray.d[i] > 0)
+        {
+            step[i] = 1;
+            out[i] = g.res[i];
+            tNext[i] = (g.AABB.min[i] + (float)(cell[i] + 1) * g.cellSize[i] - ray.o[i]) * ray.dRcp[i];
+            tDelta[i] = g.cellSize[i] * ray.dRcp[i];
+        }
+        else if (ray.d[i] < 0)
+        {
+            step[i] = -1;
+            out[i] = -1;
+            tNext[i] = (g.AABB.min[i] + (float)cell[i] * g.cellSize[i] - ray.o[i]) * ray.dRcp[i];
+            tDelta[i] = -g.cellSize[i] * ray.dRcp[i];
+        }
+        else
+        { //Never crosses a boundary along this axis
+            step[i] = 0;
+            out[i] = -1;
+            tNext[i] = tDelta[i] = std::numeric_limits<float>::infinity();
+        }
+    }
+
+    while (true)
+    {
+        //The ray leaves the cell through the nearest boundary
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        float tCellExit = std::min(tNext[axis], tExit);
+
+        const Cell& c = cells[g.firstCell + ((uint32_t)cell[2] * g.res[1] + cell[1]) * g.res[0] + cell[0]];
+        if (c.isSubGrid())
+        {
+            if (traverse(c.first, ray, tEnter, tCellExit, its, shadowRay, closeTri)) return true;
+        }
+        else
+        {
+            for (uint32_t i = c.first; i < c.first + c.count; ++i)
+            {
+                const TriInd &idx = leafTris[i];
+                float u, v, t;
+                if (leafTriIntersect(i, ray, u, v, t))
+                {
+                    closeTri = idx;
+                    if (shadowRay) return true;
+                    ray.maxt = its.t = t;
+                    its.uv = Point2f(u, v);
+                    its.mesh = meshes[idx.mesh];
+                }
+            }
+        }
+
+        //Every cell before this one has been searched, so a hit within it is the closest.
+        //  (A hit beyond it, in a triangle that also overlaps later cells, only shortens the ray.)
+        if (ray.maxt <= tCellExit) return true;
+
+        //Step into the next cell
+        if (tNext[axis] >= tExit) return false;
+        cell[axis] += step[axis];
+        if (cell[axis] == out[axis]) return false;
+        tEnter = tNext[axis];
+        tNext[axis] += tDelta[axis];
+    }
+}
+
+NORI_NAMESPACE_END
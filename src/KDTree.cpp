@@ -5,7 +5,9 @@
 #include "nori/KDTree.h"
 
 #include <chrono>
+#include <algorithm>
 #include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
 
 //Set to true for parallel construction of KD-Tree
 #define KD_PARALLEL true
@@ -14,6 +16,9 @@
 
 NORI_NAMESPACE_BEGIN
 
+static_assert(sizeof(KDTree::LinearNode) == 8, "KD-Tree nodes should stay 8 bytes");
+static_assert(sizeof(KDTree::RopeLeaf) == 56, "Update the rope memory cost in setRopes() and the README");
+
 void KDTree::build(SplitMethod method) {
     if(built) return;
     built = true;
@@ -37,14 +42,62 @@ void KDTree::build(SplitMethod method) {
 
     //Build (& time) KD-Tree
     auto startT = std::chrono::high_resolution_clock::now();
-    root = build(bbox, tris, 0, method);
+    Node* root;
+    if (method == SAHFull)
+    { //Create and sort all events once, up front
+        auto list = new EventList();
+        list->tris.swap(*tris);
+        delete tris;
+        for (uint32_t i = 0; i < list->tris.size(); ++i)
+        {
+            list->addEvents(i, getTriBB(list->tris[i], bbox));
+        }
+#if KD_PARALLEL
+        tbb::parallel_for(int(0), 3, [=](int d) {tbb::parallel_sort(list->events[d].begin(), list->events[d].end());});
+#else
+        for (auto & events : list->events)
+        {
+            std::sort(events.begin(), events.end());
+        }
+#endif
+        root = buildSAH(bbox, list, 0);
+    }
+    else
+        root = build(bbox, tris, 0, method);
+    leafTris.shrink_to_fit();
+
+    //Compact the tree for traversal, then free the pointer-based tree
+    nodes.clear();
+    if (root != nullptr)
+    {
+        nodes.reserve(root->nodeCount());
+        nodes.resize(1);
+        flatten(root, 0);
+        delete root;
+    }
     auto endT = std::chrono::high_resolution_clock::now();
     auto durT = std::chrono::duration_cast<std::chrono::milliseconds>(endT-startT);
 
     //Print some information
     std::cout << "Acceleration Structure: KD-Tree" << std::endl;
-    std::cout << "Nodes: " << root->nodeCount() << ", Tree Stored Tris: " << root->triCount() << ", Mesh Tris: " << triCt << std::endl;
+    std::cout << "Nodes: " << nodes.size() << ", Tree Stored Tris: " << leafTris.size() << ", Mesh Tris: " << triCt << std::endl;
+    std::cout << "Node Memory: " << memString(nodes.size() * sizeof(LinearNode)) << std::endl;
     std::cout << "KD-Tree Construction Time: " << durT.count() << " MS" << endl;
+
+    //Link the leaves with ropes, if enabled
+    ropeLeaves.clear();
+    ropeLeafInd.clear();
+    if (m_ropes && !nodes.empty())
+    {
+        ropeLeafInd.resize(nodes.size(), (uint32_t)NO_ROPE);
+        const uint32_t ropes[6]{NO_ROPE, NO_ROPE, NO_ROPE, NO_ROPE, NO_ROPE, NO_ROPE};
+        buildRopes(0, bbox, ropes);
+        std::cout << "Rope Memory: " << memString(ropeLeaves.size() * sizeof(RopeLeaf)
+                                                  + ropeLeafInd.size() * sizeof(uint32_t)) << std::endl;
+    }
+
+    //Store the triangles themselves in leaf order, if enabled
+    buildTriAccels();
 }
 KDTree::Node *KDTree::build(const BoundingBox3f& bb, std::vector<TriInd> *tris, int depth,
                             SplitMethod method)
@@ -59,7 +112,7 @@ KDTree::Node *KDTree::build(const BoundingBox3f& bb, std::vector<TriInd> *tris,
     //Few triangles
     if (tris->size() <= FEW_TRIS || depth >= MAX_DEPTH)
     {
-        return new Node(bb, tris, {});
+        return makeLeaf(bb, tris, {});
     }
 
     Split s = getGoodSplit(bb, tris, method);
@@ -67,7 +120,7 @@ KDTree::Node *KDTree::build(const BoundingBox3f& bb, std::vector<TriInd> *tris,
     if(!s.isValid())
     { //No advantage to splitting
         //std::cout << "invalid" << std::endl;
-        return new Node(bb, tris, s);
+        return makeLeaf(bb, tris, s);
     }
 
     //Set up AABBs
@@ -85,7 +138,7 @@ KDTree::Node *KDTree::build(const BoundingBox3f& bb, std::vector<TriInd> *tris,
                       {
                           for (auto tri: *tris) {
                               //Check if triangle in AABB i
-                              if (triIntersects(AABBs[i], tri))
+                              if (m_perfectSplits ? getTriBB(tri, AABBs[i]).isValid() : triIntersects(AABBs[i], tri))
                               {
                                   triangles[i]->push_back(tri);
                               }
@@ -97,7 +150,7 @@ KDTree::Node *KDTree::build(const BoundingBox3f& bb, std::vector<TriInd> *tris,
         for (int i = 0; i < 2; ++i)
         {
             //Check if triangle in AABB i
-            if (triIntersects(AABBs[i], tri))
+            if (m_perfectSplits ? getTriBB(tri, AABBs[i]).isValid() : triIntersects(AABBs[i], tri))
             {
                 triangles[i]->push_back(tri);
             }
@@ -119,11 +172,11 @@ KDTree::Node *KDTree::build(const BoundingBox3f& bb, std::vector<TriInd> *tris,
             for (auto &t : triangles) {
                 delete t;
             }
-            return new Node(bb, tris, {});
+            return makeLeaf(bb, tris, {});
         }
     }
 
-    Node* n = new Node(bb, nullptr, s);
+    Node* n = new Node(bb, 0, 0, s, false);
 #if KD_PARALLEL
     tbb::parallel_for(int(0), 2,
                       [=](int i)
@@ -141,154 +194,496 @@ KDTree::Node *KDTree::build(const BoundingBox3f& bb, std::vector<TriInd> *tris,
     return n;
 }
 
-KDTree::TriInd KDTree::rayIntersect(const nori::Ray3f &ray_, nori::Intersection &its, bool shadowRay) const
+void KDTree::EventList::addEvents(uint32_t tri, const BoundingBox3f &bb)
 {
-    //Use the node tri intersect function on the whole octree
-    return nodeCloseTriIntersect(root, ray_, its, shadowRay);
-
+    for (int d = 0; d < 3; ++d)
+    {
+        if (bb.min[d] == bb.max[d])
+        {
+            events[d].push_back({bb.min[d], tri, Event::Planar});
+        }
+        else
+        {
+            events[d].push_back({bb.min[d], tri, Event::Start});
+            events[d].push_back({bb.max[d], tri, Event::End});
+        }
+    }
 }
 
-KDTree::TriInd KDTree::leafRayTriIntersect(Node *n, const nori::Ray3f &ray_, nori::Intersection &its,
-                                           bool shadowRay) const
+KDTree::Node *KDTree::buildSAH(const BoundingBox3f &bb, EventList *list, int depth)
 {
-    TriInd f = {};      // Triangle index of the closest intersection
+    std::size_t triCt = list->tris.size();
+    if (triCt == 0)
+    {
+        delete list;
+        return nullptr;
+    }
 
-    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+    bool planarLeft = true;
+    Split s;
+    if (triCt > FEW_TRIS && depth < MAX_DEPTH)
+    {
+        s = getSAHSplit(bb, *list, planarLeft);
+    }
+    if (!s.isValid())
+    { //Few triangles, or no advantage to splitting
+        auto tris = new std::vector<TriInd>();
+        tris->swap(list->tris);
+        delete list;
+        return makeLeaf(bb, tris, s);
+    }
 
-    /* Brute force search through all triangles */
-    for (auto idx : *(n->tris)) {
-        float u, v, t;
-        if (meshes[idx.mesh]->rayIntersect(idx.i, ray, u, v, t)) {
-            /* An intersection was found! Can terminate
-               immediately if this is a shadow ray query */
-            if (shadowRay)
-                return idx;
-            ray.maxt = its.t = t;
-            its.uv = Point2f(u, v);
-            its.mesh = meshes[idx.mesh];
-            f = idx;
+    //1. Classify the triangles by which side(s) of the plane they lie on (all the information
+    //  needed is in the events along the split axis)
+    enum Side : uint8_t {Both, LeftOnly, RightOnly};
+    std::vector<uint8_t> sides(triCt, Both);
+    float plane = bb.min[s.d] + s.l;
+    for (const Event& e : list->events[s.d])
+    {
+        if (e.type == Event::End && e.pos <= plane)
+            sides[e.tri] = LeftOnly;
+        else if (e.type == Event::Start && e.pos >= plane)
+            sides[e.tri] = RightOnly;
+        else if (e.type == Event::Planar)
+        {
+            if (e.pos < plane || (e.pos == plane && planarLeft))
+                sides[e.tri] = LeftOnly;
+            else
+                sides[e.tri] = RightOnly;
         }
     }
 
-    return f;
-}
+    //2. Split the triangles (renumbered within each child) and their events between the children.
+    //  The events of one-sided triangles stay in order. Triangles on both sides get new events,
+    //  bounded by the child, which are sorted and then merged in. (With perfect splits, a
+    //  triangle whose AABB straddles the plane may still miss one of the children entirely.)
+    BoundingBox3f AABBs[2]{lowBB(bb, s), highBB(bb, s)};
+    EventList* lists[2]{new EventList(), new EventList()};
+    std::vector<uint32_t> childInd[2]{std::vector<uint32_t>(triCt), std::vector<uint32_t>(triCt)};
+    EventList straddling[2];
+    for (uint32_t i = 0; i < triCt; ++i)
+    {
+        for (int c = 0; c < 2; ++c)
+        {
+            if (sides[i] == (c == 0 ? RightOnly : LeftOnly)) continue;
 
-///Whether the KD tree should search using a recursive or iterative (stack) approach.
-#define RECURSIVE_SEARCH false
-KDTree::TriInd KDTree::nodeCloseTriIntersect(Node *n, const nori::Ray3f &ray_, nori::Intersection &its,
-                                             bool shadowRay) const
-{
-#if RECURSIVE_SEARCH
-    if (n == nullptr) return {};
-    if (n->isLeaf()) return leafRayTriIntersect(n, ray_, its, shadowRay);
+            BoundingBox3f triBB;
+            if (sides[i] == Both)
+            {
+                triBB = getTriBB(list->tris[i], AABBs[c]);
+                if (!triBB.isValid()) continue;
+            }
 
-    //1. Get all the child nodes that the ray intersects
-    float dists[2]{0,0};
-    bool valid[2]{false,false};
+            childInd[c][i] = (uint32_t)lists[c]->tris.size();
+            lists[c]->tris.push_back(list->tris[i]);
+            if (sides[i] == Both)
+            {
+                straddling[c].addEvents(childInd[c][i], triBB);
+            }
+        }
+    }
 
-    for (int i = 0; i < 2; ++i)
+    for (int d = 0; d < 3; ++d)
     {
-        Node* c = n->children[i];
-        if (c != nullptr)
+        const std::vector<Event>& events = list->events[d];
+        for (int c = 0; c < 2; ++c)
         {
-            float close, far;
-            if(c->AABB.rayIntersect(ray_, close, far))
+            Side only = c == 0 ? LeftOnly : RightOnly;
+            std::vector<Event> oneSided;
+            oneSided.reserve(events.size());
+            for (const Event& e : events)
             {
-                dists[i] = close;
-                valid[i] = true;
+                if (sides[e.tri] == only)
+                    oneSided.push_back({e.pos, childInd[c][e.tri], e.type});
             }
+
+            std::vector<Event>& newEvents = straddling[c].events[d];
+            std::sort(newEvents.begin(), newEvents.end());
+
+            std::vector<Event>& merged = lists[c]->events[d];
+            merged.resize(oneSided.size() + newEvents.size());
+            std::merge(oneSided.begin(), oneSided.end(), newEvents.begin(), newEvents.end(), merged.begin());
         }
     }
 
-    if (!valid[0])
+    //we arent using the parent's events anymore, so delete them
+    delete list;
+
+    Node* n = new Node(bb, 0, 0, s, false);
+#if KD_PARALLEL
+    if (triCt >= PARALLEL_TRIS)
     {
-        dists[0] = dists[1] + 1;
+        tbb::parallel_for(int(0), 2,
+                          [=](int i)
+                          {n->children[i] = buildSAH(AABBs[i], lists[i], depth + 1);});
+        return n;
     }
-    if (!valid[1])
+#endif
+    for (int i = 0; i < 2; ++i)
     {
-        dists[1] = dists[0] + 1;
+        n->children[i] = buildSAH(AABBs[i], lists[i], depth + 1);
     }
 
-    //2. Search for triangles in child nodes
-    //Go through valid child nodes only (Starting with closest)
-    if(valid[0] && dists[0] < dists[1])
-    { //"lower" node is closer
-        TriInd interPlace = nodeCloseTriIntersect(n->children[0], ray_, its, shadowRay);
-        if (interPlace.isValid())
-        { //Found a triangle !!! (also quick terminate)
-            return interPlace;
-        }
-        if(valid[1])
+    return n;
+}
+
+KDTree::Split KDTree::getSAHSplit(const BoundingBox3f &bb, const EventList &list, bool &planarLeft) const
+{
+    auto triCt = (float)list.tris.size();
+
+    Split bestS;
+    float minSAH = TRI_INT_COST*triCt + 1;
+
+    //The size of the AABB
+    Vector3f sz = bb.max-bb.min;
+    ///SA of the whole BB
+    float bbSA = bb.getSurfaceArea();
+
+    //Dimension loop
+    for (int d = 0; d < 3; ++d)
+    {
+        //AXIS constants
+        int d2 = (d+1)%3, d3 = (d+2)%3;
+
+        //Some constants for use in upcoming calculations
+        //Plane ortho to axis surface area
+        float axSA = 2 * sz[d2] * sz[d3];
+        //basically the perimeter of above
+        float axDist = 2 * (sz[d2] + sz[d3]);
+        //A constant for the higher box
+        float axMaxConst = axSA + sz[d] * axDist;
+
+        //Sweep the (sorted) events, keeping count of the triangles to the left, to the right,
+        //  and within each candidate plane
+        const std::vector<Event>& events = list.events[d];
+        float nl = 0, nr = triCt;
+        std::size_t i = 0;
+        while (i < events.size())
         {
-            interPlace = nodeCloseTriIntersect(n->children[1], ray_, its, shadowRay);
-            if (interPlace.isValid())
-            { //Found a triangle !!! (also quick terminate)
-                return interPlace;
+            float pos = events[i].pos;
+            float ends = 0, planars = 0, starts = 0;
+            for (; i < events.size() && events[i].pos == pos && events[i].type == Event::End; ++i) ++ends;
+            for (; i < events.size() && events[i].pos == pos && events[i].type == Event::Planar; ++i) ++planars;
+            for (; i < events.size() && events[i].pos == pos && events[i].type == Event::Start; ++i) ++starts;
+
+            nr -= ends + planars;
+
+            float off = pos - bb.min[d];
+            if (0 < off && off < sz[d])
+            {
+                ///Probability of intersecting the "lower" node
+                float pl = axSA + off * axDist;
+
+                ///Probability of intersecting the "higher" node
+                float ph = axMaxConst - off * axDist;
+
+                //Try the triangles within the plane on either side
+                for (int side = 0; side < 2; ++side)
+                {
+                    float lCost = TRI_INT_COST * (nl + (side == 0 ? planars : 0));
+                    float hCost = TRI_INT_COST * (nr + (side == 1 ? planars : 0));
+
+                    float sah = TRAVERSAL_TIME + (pl * lCost + ph * hCost) / bbSA;
+                    if (lCost == 0 || hCost == 0)
+                        sah *= EMPTY_MODIFIER;
+
+                    if (sah <= minSAH)
+                    {
+                        minSAH = sah;
+                        bestS = {d, off};
+                        planarLeft = side == 0;
+                    }
+                }
             }
+
+            nl += starts + planars;
         }
     }
-    else if (valid[1])
-    { //"higher" node is closer
-        TriInd interPlace = nodeCloseTriIntersect(n->children[1], ray_, its, shadowRay);
-        if (interPlace.isValid())
-        { //Found a triangle !!! (also quick terminate)
-            return interPlace;
+
+    //If the SAH isnt better than just no split, then dont split (invalid split return)
+    return minSAH < TRI_INT_COST*triCt ? bestS : Split{x, -1};
+}
+
+KDTree::Node *KDTree::makeLeaf(const BoundingBox3f &bb, std::vector<TriInd> *tris, Split s)
+{
+    uint32_t start = addLeafTris(*tris);
+    auto end = start + (uint32_t)tris->size();
+    delete tris;
+    return new Node(bb, start, end, s, true);
+}
+
+void KDTree::flatten(const Node *n, uint32_t index)
+{
+    if (n == nullptr)
+    { //Empty child
+        nodes[index] = LinearNode::leaf(0, 0);
+        return;
+    }
+
+    if (n->isLeaf())
+    {
+        nodes[index] = LinearNode::leaf(n->triStart, n->triEnd - n->triStart);
+        return;
+    }
+
+    //Both children are stored next to each other
+    auto children = (uint32_t)nodes.size();
+    nodes.resize(children + 2);
+    nodes[index] = LinearNode::interior(n->s.d, n->AABB.min[n->s.d] + n->s.l, children);
+    flatten(n->children[0], children);
+    flatten(n->children[1], children + 1);
+}
+
+void KDTree::buildRopes(uint32_t index, const BoundingBox3f &bb, const uint32_t (&ropes)[6])
+{
+    const LinearNode& n = nodes[index];
+    if (n.isLeaf())
+    {
+        ropeLeafInd[index] = (uint32_t)ropeLeaves.size();
+        RopeLeaf leaf{bb, n.first, n.triCount(), {}};
+        std::copy(ropes, ropes + 6, leaf.ropes);
+        ropeLeaves.push_back(leaf);
+        return;
+    }
+
+    //Each child's face on the split plane leads to the other child
+    int d = n.axis();
+    BoundingBox3f AABBs[2]{bb, bb};
+    AABBs[0].max[d] = n.split;
+    AABBs[1].min[d] = n.split;
+
+    for (int c = 0; c < 2; ++c)
+    {
+        uint32_t childRopes[6];
+        for (int f = 0; f < 6; ++f)
+        {
+            childRopes[f] = ropes[f];
         }
-        if(valid[0])
+        childRopes[2 * d + (c == 0 ? 1 : 0)] = n.children() + (c == 0 ? 1 : 0);
+
+        for (int f = 0; f < 6; ++f)
         {
-            interPlace = nodeCloseTriIntersect(n->children[0], ray_, its, shadowRay);
-            if (interPlace.isValid())
-            { //Found a triangle !!! (also quick terminate)
-                return interPlace;
-            }
+            childRopes[f] = optimizeRope(childRopes[f], f, AABBs[c]);
         }
+        buildRopes(n.children() + c, AABBs[c], childRopes);
     }
+}
 
-    return {};
-#else
-    Node* stack[MAX_DEPTH + 1];
-    ///Stack index
-    int si = 0;
+uint32_t KDTree::optimizeRope(uint32_t rope, int f, const BoundingBox3f &bb) const
+{
+    int faceAxis = f / 2;
+    bool maxFace = f % 2 == 1;
+    while (rope != NO_ROPE && !nodes[rope].isLeaf())
+    {
+        const LinearNode& n = nodes[rope];
+        int d = n.axis();
+        if (d == faceAxis)
+        { //Parallel to the face, so only the child on the face's side touches it
+            rope = n.children() + (maxFace ? 0 : 1);
+        }
+        else if (n.split <= bb.min[d])
+        { //The whole face is above the split
+            rope = n.children() + 1;
+        }
+        else if (n.split >= bb.max[d])
+        { //The whole face is below the split
+            rope = n.children();
+        }
+        else break;
+    }
+    return rope;
+}
 
-    float close, far;
-    stack[0] = n;
-    while(si >= 0)
+template <bool shadowRay>
+KDTree::TriInd KDTree::ropeCloseTriIntersect(const nori::Ray3f &ray_, nori::Intersection &its) const
+{
+    float tEntry, tExit;
+    if (!bbox.rayIntersect(ray_, tEntry, tExit)) return {};
+    tEntry = std::max(tEntry, ray_.mint);
+
+    TriInd closeTri = {};
+    Ray3f ray(ray_); /// Shortened to the closest hit so far
+    uint32_t node = 0;
+    //(Guards against round-off sending the ray around in circles)
+    for (std::size_t step = 0; step < ropeLeaves.size() && tEntry <= std::min(tExit, ray.maxt); ++step)
     {
-        Node* cur = stack[si];
-        --si;
-        if(cur == nullptr || !cur->AABB.rayIntersect(ray_, close, far)) continue;
+        //1. Find the leaf that contains the point where the ray enters the current node
+        Point3f p = ray(tEntry);
+        while (!nodes[node].isLeaf())
+        {
+            const LinearNode& n = nodes[node];
+            int d = n.axis();
+            bool low = p[d] < n.split || (p[d] == n.split && ray.d[d] < 0);
+            node = n.children() + (low ? 0 : 1);
+        }
+        const RopeLeaf& leaf = ropeLeaves[ropeLeafInd[node]];
 
-        if (cur->isLeaf())
-        { //Since this node is "first", it MUST be the closest
-            TriInd inter = leafRayTriIntersect(cur, ray_, its, shadowRay);
-            if(inter.isValid())
+        //2. Find where (and through which face) the ray leaves it
+        float tLeave = std::numeric_limits<float>::infinity();
+        int face = -1;
+        for (int d = 0; d < 3; ++d)
+        {
+            if (ray.d[d] == 0) continue;
+            bool up = ray.d[d] > 0;
+            float t = ((up ? leaf.AABB.max[d] : leaf.AABB.min[d]) - ray.o[d]) * ray.dRcp[d];
+            if (t < tLeave)
             {
-                return inter;
+                tLeave = t;
+                face = 2 * d + (up ? 1 : 0);
             }
         }
-        else
+
+        //3. Test its triangles. A hit within the leaf is the closest, since all leaves
+        //  before it have been searched. (A hit beyond it only shortens the ray.)
+        if (leaf.count > 0)
         {
-            if(ray_.d[cur->s.d] >= 0)
-            { //0 node closer (or just invalid idk)
-                ++si;
-                stack[si] = cur->children[1];
-                ++si;
-                stack[si] = cur->children[0];
+            LinearNode n = LinearNode::leaf(leaf.first, leaf.count);
+            TriInd inter = leafRayTriIntersect<shadowRay>(n, ray, its);
+            if (inter.isValid())
+            {
+                if (shadowRay) return inter;
+                closeTri = inter;
+                ray.maxt = its.t;
+            }
+        }
+        if (face == -1 || ray.maxt <= tLeave) break;
+
+        //4. Follow the rope through that face
+        node = leaf.ropes[face];
+        if (node == NO_ROPE) break;
+        tEntry = std::max(tEntry, tLeave);
+    }
+
+    return closeTri;
+}
+
+KDTree::TriInd KDTree::rayIntersect(const nori::Ray3f &ray_, nori::Intersection &its, bool shadowRay) const
+{
+    if (nodes.empty()) return {};
+
+    if (!ropeLeaves.empty())
+        return shadowRay ? ropeCloseTriIntersect<true>(ray_, its) : ropeCloseTriIntersect<false>(ray_, its);
+
+    //Use the node tri intersect function on the whole tree (shadow rays only need any hit)
+    if (shadowRay) return nodeCloseTriIntersect<true>(ray_, its);
+    return nodeCloseTriIntersect<false>(ray_, its);
+
+}
+
+template <bool shadowRay>
+KDTree::TriInd KDTree::leafRayTriIntersect(const LinearNode &n, const nori::Ray3f &ray_, nori::Intersection &its) const
+{
+    TriInd f = {};      // Triangle index of the closest intersection
+
+    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+
+    /* Brute force search through all triangles */
+    for (uint32_t i = n.first; i < n.first + n.triCount(); ++i) {
+        const TriInd &idx = leafTris[i];
+        float u, v, t;
+        if (leafTriIntersect(i, ray, u, v, t)) {
+            /* An intersection was found! Can terminate
+               immediately if this is a shadow ray query */
+            if (shadowRay)
+                return idx;
+            ray.maxt = its.t = t;
+            its.uv = Point2f(u, v);
+            its.mesh = meshes[idx.mesh];
+            f = idx;
+        }
+    }
+
+    return f;
+}
+
+template <bool shadowRay>
+KDTree::TriInd KDTree::nodeCloseTriIntersect(const nori::Ray3f &ray_, nori::Intersection &its) const
+{
+    float tMin, tMax;
+    if (!bbox.rayIntersect(ray_, tMin, tMax)) return {};
+    tMin = std::max(tMin, ray_.mint);
+    tMax = std::min(tMax, ray_.maxt);
+    if (tMin > tMax) return {};
+
+    /// A far node to visit later, and the ray's interval within it
+    struct StackEntry
+    {
+        uint32_t node;
+        float tMin, tMax;
+    };
+    StackEntry stack[MAX_DEPTH + 2];
+    ///Stack index
+    int si = -1;
+
+    TriInd closeTri = {};
+    Ray3f ray(ray_); /// Shortened to the closest hit so far
+    uint32_t node = 0;
+    while (true)
+    {
+        //Descend to the nearest leaf along [tMin, tMax], pushing far children to visit later
+        while (!nodes[node].isLeaf())
+        {
+            const LinearNode& n = nodes[node];
+            int d = n.axis();
+            //Where the ray crosses the split plane (never, if it is parallel to it)
+            float tSplit = ray.d[d] == 0 ? std::numeric_limits<float>::infinity()
+                                         : (n.split - ray.o[d]) * ray.dRcp[d];
+
+            //The child the ray's origin is in is "near"
+            bool lowFirst = ray.o[d] < n.split || (ray.o[d] == n.split && ray.d[d] <= 0);
+            uint32_t nearChild = n.children() + (lowFirst ? 0 : 1);
+            uint32_t farChild = n.children() + (lowFirst ? 1 : 0);
+
+            if (tSplit > tMax || tSplit <= 0)
+            { //Only the near child is crossed within the interval
+                node = nearChild;
+            }
+            else if (tSplit < tMin)
+            { //Only the far child is
+                node = farChild;
             }
             else
-            {//1 node is closer
-                ++si;
-                stack[si] = cur->children[0];
-                ++si;
-                stack[si] = cur->children[1];
+            {
+                stack[++si] = {farChild, tSplit, tMax};
+                node = nearChild;
+                tMax = tSplit;
             }
+        }
 
+        const LinearNode& n = nodes[node];
+        if (n.triCount() > 0)
+        {
+            TriInd inter = leafRayTriIntersect<shadowRay>(n, ray, its);
+            if (inter.isValid())
+            {
+                //Every leaf before this one has been searched, so a hit within this leaf is
+                //  the closest. (A hit beyond it may still be beaten by a nearer leaf's triangles.)
+                if (shadowRay || its.t <= tMax) return inter;
+                closeTri = inter;
+                ray.maxt = its.t;
+            }
         }
 
+        //Continue with the next far node, unless it starts beyond the closest hit so far
+        if (si < 0) break;
+        node = stack[si].node;
+        tMin = stack[si].tMin;
+        tMax = std::min(stack[si].tMax, ray.maxt);
+        --si;
+        if (tMin > tMax) break;
     }
 
-    return {};
-#endif
+    return closeTri;
+}
+
+BoundingBox3f KDTree::getTriBB(const TriInd &t, const BoundingBox3f &bb) const
+{
+    if (m_perfectSplits)
+        return clippedTriBB(t, bb);
+
+    BoundingBox3f triBB = getTriBB(t);
+    triBB.clip(bb);
+    return triBB;
 }
 
 BoundingBox3f KDTree::lowBB(const BoundingBox3f &bb, Split s) {
@@ -310,84 +705,7 @@ BoundingBox3f KDTree::highBB(const BoundingBox3f &bb, Split s) {
 ///Whether the SAH is implemented or not. Also allows for speed comparisons.
 KDTree::Split KDTree::getGoodSplit(const BoundingBox3f &bb, std::vector<TriInd> *tris,
                                    SplitMethod method) const {
-    if (method == SAHFull)
-    {
-
-        Split bestS;
-        float minSAH = TRI_INT_COST*tris->size() + 1;
-
-        //The size of the AABB
-        Vector3f sz = bb.max-bb.min;
-        float totTriCost = tris->size()*TRI_INT_COST;
-        ///SA of the whole BB
-        float bbSA = bb.getSurfaceArea();
-
-        //Construct an array with both start and end pts
-        std::vector<TriSAH> triPts(tris->size()*2);
-        for(std::size_t i = 0; i < tris->size(); ++i)
-        {
-            TriInd t = (*tris)[i];
-            //Min pt
-            triPts[i] = {t, getTriBB(t).min-bb.min, true};
-            //max pt
-            triPts[tris->size()+i] = {t, getTriBB(t).max-bb.min, false};
-        }
-
-
-        //Dimension loop
-        for (int d = 0; d < 3; ++d)
-        {
-            //AXIS constants
-            int d2 = (d+1)%3, d3 = (d+2)%3;
-
-            //Some constants for use in upcoming calculations
-            //Plane ortho to axis surface area
-            float axSA = 2 * sz[d2] * sz[d3];
-            //basically the perimeter of above
-            float axDist = 2 * (sz[d2] + sz[d3]);
-            //A constant for the higher box
-            float axMaxConst = axSA + sz[d] * axDist;
-
-            //Try with the min axis bounds
-            std::sort(triPts.begin(), triPts.end(), [d](const TriSAH &a, const TriSAH &b) {
-                return a.pt[d] <
-                       b.pt[d];
-            });
-            float lCost = 0;
-            float hCost = totTriCost;
-            for (auto t: triPts) {
-                if(!t.min) hCost -= TRI_INT_COST;
-
-                if(0 < t.pt[d]  && t.pt[d] < sz[d]) {
-                    ///Probability of intersecting the "lower" node
-                    float pl = axSA + t.pt[d] * axDist;
-
-                    ///Probability of intersecting the "higher" node
-                    float ph = axMaxConst - t.pt[d] * axDist;
-
-                    float sah = TRAVERSAL_TIME + (pl * lCost + ph * hCost) / bbSA;
-                    if (lCost == 0 || hCost == 0)
-                        sah *= EMPTY_MODIFIER;
-
-                    if (sah <= minSAH) {
-                        //std::cout << "Dim " << d << ", lCost " << lCost << ", hCost " << hCost << ", totTriCost " << totTriCost << ", SAH " << sah << std::endl;
-                        //std::cout << "BBSA " << bbSA << ", pt " << t.pt[d] << ", pl " << pl << ", ph " << ph << ", totTriCost " << totTriCost << ", SAH " << sah << std::endl;
-                        minSAH = sah;
-                        bestS = {d, t.pt[d]};
-                    }
-                }
-
-                if(t.min) lCost += TRI_INT_COST;
-
-            }
-
-        }
-
-        //If the SAH isnt better than just no split, then dont split (invalid split return)
-        return minSAH < TRI_INT_COST*tris->size() ? bestS : Split{x, -1};
-    }
-
-    else if (method == Midpoint)
+    if (method == Midpoint)
     {
         //DUMMY TRIVIAL IMPLEMENTATION
         //      SPLIT LONGEST DIMENSION IN 2
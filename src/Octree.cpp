@@ -14,6 +14,8 @@
 
 NORI_NAMESPACE_BEGIN
 
+static_assert(sizeof(Octree::LinearNode) == 8, "Octree nodes should stay 8 bytes");
+
 void nori::Octree::build() {
     if(built) return;
     built = true;
@@ -37,14 +39,38 @@ void nori::Octree::build() {
 
     //Build (& time) Octree
     auto startOct = std::chrono::high_resolution_clock::now();
-    root = build(bbox, tris, 0);
+    Node* root = m_loose ? buildLoose(bbox, tris, 0) : build(bbox, tris, 0);
+    leafTris.shrink_to_fit();
+
+    //Compact the tree for traversal, then free the pointer-based tree
+    nodes.clear();
+    nodeTris.clear();
+    rootLeaf = false;
+    if (root != nullptr)
+    {
+        nodes.reserve(root->nodeCount());
+        nodes.resize(1);
+        if (m_loose) nodeTris.resize(1, {0, 0});
+        if (root->isLeaf())
+        {
+            nodes[0] = LinearNode::leaf(root->triStart, root->triEnd - root->triStart);
+            rootLeaf = true;
+        }
+        else
+            flatten(root, 0);
+        delete root;
+    }
     auto endOct = std::chrono::high_resolution_clock::now();
     auto durOct = std::chrono::duration_cast<std::chrono::milliseconds>(endOct-startOct);
 
     //Print some information
-    std::cout << "Acceleration Structure: Octree" << std::endl;
-    std::cout << "Nodes: " << root->nodeCount() << ", Tree Stored Tris: " << root->triCount() << ", Mesh Tris: " << triCt << std::endl;
+    std::cout << "Acceleration Structure: " << (m_loose ? "Loose Octree" : "Octree") << std::endl;
+    std::cout << "Nodes: " << nodes.size() << ", Tree Stored Tris: " << leafTris.size() << ", Mesh Tris: " << triCt << std::endl;
+    std::cout << "Node Memory: " << memString(nodes.size() * sizeof(LinearNode) + nodeTris.size() * sizeof(TriRange)) << std::endl;
     std::cout << "Octree Construction Time: " << durOct.count() << " MS" << endl;
+
+    //Store the triangles themselves in leaf order, if enabled
+    buildTriAccels();
 }
 nori::Octree::Node *nori::Octree::build(const nori::BoundingBox3f& bb, std::vector<TriInd> *tris, int depth)
 {//No Triangles
@@ -58,7 +84,7 @@ nori::Octree::Node *nori::Octree::build(const nori::BoundingBox3f& bb, std::vect
     //Few triangles
     if (tris->size() <= FEW_TRIS || depth >= MAX_DEPTH)
     {
-        return new Node(bb, tris);
+        return makeLeaf(bb, tris);
     }
 
     //Set up AABBs
@@ -114,10 +140,10 @@ nori::Octree::Node *nori::Octree::build(const nori::BoundingBox3f& bb, std::vect
         {
             delete t;
         }
-        return new Node(bb, tris);
+        return makeLeaf(bb, tris);
     }
 
-    Node* n = new Node(bb, nullptr);
+    Node* n = new Node(bb, 0, 0, false);
 #if OCT_PARALLEL
     tbb::parallel_for(int(0), 8,
                       [=](int i)
@@ -135,24 +161,146 @@ nori::Octree::Node *nori::Octree::build(const nori::BoundingBox3f& bb, std::vect
     return n;
 }
 
+Octree::Node *Octree::buildLoose(const BoundingBox3f &bb, std::vector<TriInd> *tris, int depth)
+{
+    if (tris->empty())
+    {
+        delete tris;
+        return nullptr;
+    }
+
+    //Few triangles
+    if (tris->size() <= FEW_TRIS || depth >= MAX_DEPTH)
+    {
+        return makeLeaf(bb, tris);
+    }
+
+    //Pass each triangle down to the child its center is in, unless it is too large for that
+    //  child's loose box (then it stays in this node)
+    Vector3f center = bb.getCenter();
+    BoundingBox3f AABBs[8];
+    std::vector<TriInd>* triangles[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        AABBs[i] = childBB(bb, i);
+        triangles[i] = new std::vector<TriInd>();
+    }
+    std::vector<TriInd> own;
+    for (auto tri : *tris)
+    {
+        BoundingBox3f triBB = meshes[tri.mesh]->getBoundingBox(tri.i);
+        Point3f triCenter = triBB.getCenter();
+        int c = (triCenter.x() >= center.x() ? 1 : 0) + (triCenter.y() >= center.y() ? 2 : 0)
+                + (triCenter.z() >= center.z() ? 4 : 0);
+        if (looseBB(AABBs[c]).contains(triBB))
+            triangles[c]->push_back(tri);
+        else
+            own.push_back(tri);
+    }
+
+    //Nothing fits in any child
+    if (own.size() == tris->size())
+    {
+        for(auto & t : triangles)
+        {
+            delete t;
+        }
+        return makeLeaf(bb, tris);
+    }
+    delete tris;
+
+    uint32_t start = addLeafTris(own);
+    Node* n = new Node(bb, start, start + (uint32_t)own.size(), false);
+#if OCT_PARALLEL
+    tbb::parallel_for(int(0), 8,
+                      [=](int i)
+                      {n->children[i] = buildLoose(AABBs[i], triangles[i], depth + 1);});
+#else
+    for (int i = 0; i < 8; ++i)
+    {
+        n->children[i] = buildLoose(AABBs[i], triangles[i], depth + 1);
+    }
+#endif
+
+    return n;
+}
+
+BoundingBox3f Octree::looseBB(const BoundingBox3f &bb)
+{
+    Vector3f grow = 0.5f * (LOOSENESS - 1.0f) * bb.getExtents();
+    return {bb.min - grow, bb.max + grow};
+}
+
+Octree::Node *Octree::makeLeaf(const BoundingBox3f &bb, std::vector<TriInd> *tris)
+{
+    uint32_t start = addLeafTris(*tris);
+    auto end = start + (uint32_t)tris->size();
+    delete tris;
+    return new Node(bb, start, end, true);
+}
+
+void Octree::flatten(const Node *n, uint32_t index)
+{
+    //The non-empty children are stored next to each other
+    uint8_t childMask = 0, leafMask = 0;
+    uint32_t count = 0;
+    for (int c = 0; c < 8; ++c)
+    {
+        if (n->children[c] == nullptr) continue;
+        ++count;
+        childMask |= 1 << c;
+        if (n->children[c]->isLeaf()) leafMask |= 1 << c;
+    }
+    auto children = (uint32_t)nodes.size();
+    nodes.resize(children + count);
+    nodes[index] = LinearNode::interior(children, childMask, leafMask);
+    if (m_loose)
+    {
+        nodeTris.resize(nodes.size(), {0, 0});
+        nodeTris[index] = {n->triStart, n->triEnd - n->triStart};
+    }
+
+    for (int c = 0; c < 8; ++c)
+    {
+        const Node* child = n->children[c];
+        if (child == nullptr) continue;
+        if (child->isLeaf())
+            nodes[children] = LinearNode::leaf(child->triStart, child->triEnd - child->triStart);
+        else
+            flatten(child, children);
+        ++children;
+    }
+}
+
 Octree::TriInd Octree::rayIntersect(const nori::Ray3f &ray_, nori::Intersection &its, bool shadowRay) const
 {
-    //Use the node tri intersect function on the whole octree
-    return nodeCloseTriIntersect(root, ray_, its, shadowRay);
+    if (nodes.empty()) return {};
+    if (rootLeaf)
+    {
+        if (shadowRay) return leafRayTriIntersect<true>(nodes[0], ray_, its);
+        return leafRayTriIntersect<false>(nodes[0], ray_, its);
+    }
+    if (m_loose)
+        return shadowRay ? looseCloseTriIntersect<true>(ray_, its) : looseCloseTriIntersect<false>(ray_, its);
+
+    //Use the node tri intersect function on the whole octree (shadow rays only need any hit)
+    if (shadowRay) return nodeCloseTriIntersect<true>(ray_, its);
+    return nodeCloseTriIntersect<false>(ray_, its);
 
 }
 
-Octree::TriInd Octree::leafRayTriIntersect(nori::Octree::Node *n, const nori::Ray3f &ray_, nori::Intersection &its,
-                                           bool shadowRay) const
+template <bool shadowRay>
+Octree::TriInd Octree::leafRayTriIntersect(const LinearNode &n, const nori::Ray3f &ray_, nori::Intersection &its) const
 {
     TriInd f = {};      // Triangle index of the closest intersection
 
     Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
 
     /* Brute force search through all triangles */
-    for (auto idx : *(n->tris)) {
+    for (uint32_t i = n.offset; i < n.offset + n.triCount(); ++i) {
+        const TriInd &idx = leafTris[i];
         float u, v, t;
-        if (meshes[idx.mesh]->rayIntersect(idx.i, ray, u, v, t)) {
+        if (leafTriIntersect(i, ray, u, v, t)) {
             /* An intersection was found! Can terminate
                immediately if this is a shadow ray query */
             if (shadowRay)
@@ -167,45 +315,185 @@ Octree::TriInd Octree::leafRayTriIntersect(nori::Octree::Node *n, const nori::Ra
     return f;
 }
 
-Octree::TriInd Octree::nodeCloseTriIntersect(nori::Octree::Node *n, const nori::Ray3f &ray_, nori::Intersection &its,
-                                             bool shadowRay) const
+template <bool shadowRay>
+Octree::TriInd Octree::nodeCloseTriIntersect(const nori::Ray3f &ray_, nori::Intersection &its) const
 {
-    if (n == nullptr) return {};
-    if (n->isLeaf()) return leafRayTriIntersect(n, ray_, its, shadowRay);
+    //Mirror the ray (about the scene's center) along every axis it points down, so it only moves
+    //  up. Child c of the mirrored node is then child c ^ mirror of the actual node.
+    int mirror = 0;
+    Vector3f t0, t1;
+    for (int i = 0; i < 3; ++i)
+    {
+        float o = ray_.o[i], d = ray_.d[i];
+        if (d < 0)
+        {
+            o = bbox.min[i] + bbox.max[i] - o;
+            d = -d;
+            mirror |= 1 << i;
+        }
+        //(A ray parallel to an axis is given a tiny slope, so no t is NaN)
+        float dRcp = 1.0f / std::max(d, 1e-20f);
+        t0[i] = (bbox.min[i] - o) * dRcp;
+        t1[i] = (bbox.max[i] - o) * dRcp;
+    }
+    if (t0.maxCoeff() > t1.minCoeff() || t1.minCoeff() < ray_.mint) return {};
 
-    //1. Get all the child nodes that the ray intersects
-    NodeComp ints[8];
-    uint32_t totalInts = 0;
+    /// An interior node being traversed (index into nodes), the ray parameters at its min corner
+    ///     and max corner, and the next of its children to visit (in the mirrored node)
+    struct StackEntry
+    {
+        uint32_t n;
+        Vector3f t0, t1;
+        int next;
+    };
+    StackEntry stack[MAX_DEPTH + 2];
+    ///Stack index
+    int si = 0;
+    stack[0] = {0, t0, t1, firstChild(t0, 0.5f * (t0 + t1))};
 
-    for (auto c : n->children)
+    TriInd closeTri = {};
+    Ray3f ray(ray_); /// Shortened to the closest hit so far
+    while (si >= 0)
     {
-        if (c != nullptr)
+        StackEntry& cur = stack[si];
+        if (cur.next == 8)
+        { //Every child the ray crosses has been visited
+            --si;
+            continue;
+        }
+
+        //The child's corners are either the node's corners or its center, along each axis
+        int c = cur.next;
+        Vector3f tm = 0.5f * (cur.t0 + cur.t1);
+        Vector3f ct0, ct1;
+        for (int i = 0; i < 3; ++i)
+        {
+            bool high = (c >> i) & 1;
+            ct0[i] = high ? tm[i] : cur.t0[i];
+            ct1[i] = high ? cur.t1[i] : tm[i];
+        }
+        cur.next = nextChild(c, ct1);
+
+        const LinearNode& n = nodes[cur.n];
+        int actual = c ^ mirror;
+        if (!n.hasChild(actual)) continue;
+        uint32_t child = n.child(actual);
+
+        float tEnter = ct0.maxCoeff(), tExit = ct1.minCoeff();
+        //Children are crossed front to back, so nothing after a child beyond the closest hit is closer
+        if (tEnter > ray.maxt) break;
+        if (tExit < ray.mint) continue;
+
+        if (n.childIsLeaf(actual))
         {
-            float close, far;
-            if(c->AABB.rayIntersect(ray_, close, far))
+            TriInd inter = leafRayTriIntersect<shadowRay>(nodes[child], ray, its);
+            if (inter.isValid())
             {
-                ints[totalInts] = {close, c};
-                totalInts++;
+                //Every leaf before this one has been searched, so a hit within this leaf is the
+                //  closest. (A hit beyond it may still be beaten by a nearer leaf's triangles.)
+                if (shadowRay || its.t <= tExit) return inter;
+                closeTri = inter;
+                ray.maxt = its.t;
             }
         }
+        else
+        {
+            stack[++si] = {child, ct0, ct1, firstChild(ct0, 0.5f * (ct0 + ct1))};
+        }
     }
 
-    //Sort child nodes by close first
-    std::sort(ints,ints+totalInts);
+    return closeTri;
+}
 
-    //2. Search for triangles in child nodes
-    //Go through valid child nodes only (Starting with closest)
-    for(uint32_t i = 0; i < totalInts; ++i)
+template <bool shadowRay>
+Octree::TriInd Octree::looseCloseTriIntersect(const nori::Ray3f &ray_, nori::Intersection &its) const
+{
+    /// A node to visit (index into nodes), its cell, and whether it is a leaf
+    struct StackEntry
     {
-        Node* c = ints[i].n;
-        TriInd interPlace = nodeCloseTriIntersect(c, ray_, its, shadowRay);
-        if (interPlace.isValid())
-        { //Found a triangle !!! (also quick terminate)
-            return interPlace;
+        uint32_t n;
+        BoundingBox3f bb;
+        bool leaf;
+    };
+    StackEntry stack[7 * (MAX_DEPTH + 1) + 1];
+    ///Stack index
+    int si = 0;
+    stack[0] = {0, bbox, false};
+
+    //Children are pushed so the one nearest the ray's origin corner is visited first
+    int mirror = (ray_.d.x() < 0 ? 1 : 0) | (ray_.d.y() < 0 ? 2 : 0) | (ray_.d.z() < 0 ? 4 : 0);
+
+    TriInd closeTri = {};
+    Ray3f ray(ray_); /// Shortened to the closest hit so far, so farther nodes are skipped
+    while (si >= 0)
+    {
+        StackEntry cur = stack[si];
+        --si;
+        if (!looseBB(cur.bb).rayIntersect(ray)) continue;
+
+        const LinearNode& n = nodes[cur.n];
+        TriInd inter = cur.leaf ? rangeRayTriIntersect<shadowRay>(n.offset, n.triCount(), ray, its)
+                                : rangeRayTriIntersect<shadowRay>(nodeTris[cur.n].first,
+                                                                  nodeTris[cur.n].count, ray, its);
+        if (inter.isValid())
+        {
+            if (shadowRay) return inter;
+            closeTri = inter;
+        }
+        if (cur.leaf) continue;
+
+        for (int k = 7; k >= 0; --k)
+        {
+            int c = k ^ mirror;
+            if (n.hasChild(c))
+                stack[++si] = {n.child(c), childBB(cur.bb, c), n.childIsLeaf(c)};
+        }
+    }
+
+    return closeTri;
+}
+
+template <bool shadowRay>
+Octree::TriInd Octree::rangeRayTriIntersect(uint32_t first, uint32_t count, Ray3f &ray,
+                                            Intersection &its) const
+{
+    TriInd f = {};
+    for (uint32_t i = first; i < first + count; ++i) {
+        const TriInd &idx = leafTris[i];
+        float u, v, t;
+        if (leafTriIntersect(i, ray, u, v, t)) {
+            if (shadowRay)
+                return idx;
+            ray.maxt = its.t = t;
+            its.uv = Point2f(u, v);
+            its.mesh = meshes[idx.mesh];
+            f = idx;
         }
     }
+    return f;
+}
+
+int Octree::firstChild(const Vector3f &t0, const Vector3f &tm)
+{
+    //The ray enters through the plane of the largest t0. The child it enters is on the high side
+    //  of each other axis whose midplane it has already crossed by then.
+    int entry;
+    float tEnter = t0.maxCoeff(&entry);
+    int c = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        if (i != entry && tm[i] < tEnter) c |= 1 << i;
+    }
+    return c;
+}
 
-    return {};
+int Octree::nextChild(int c, const Vector3f &t1)
+{
+    //The ray leaves through the plane of the smallest t1, into the high side of that axis
+    //  (unless it is already on the high side, in which case it leaves the parent)
+    int exit;
+    t1.minCoeff(&exit);
+    return (c >> exit) & 1 ? 8 : c | (1 << exit);
 }
 
 nori::BoundingBox3f nori::Octree::childBB(const nori::BoundingBox3f& bb, int index) {
@@ -0,0 +1,289 @@
+//
+// A 4-wide BVH, collapsed from the binary SAH BVH.
+//
+
+#include "nori/QBVH.h"
+
+#include <chrono>
+
+//Whether SSE is available for the 4-wide box tests (otherwise a scalar loop is used)
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define QBVH_SSE true
+#include <xmmintrin.h>
+#else
+#define QBVH_SSE false
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+QBVH::Node::Node()
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        setBounds(i, BoundingBox3f());
+        child[i] = 0;
+        triCount[i] = 0;
+    }
+    for (auto & a : axes) a = 0;
+    for (auto & p : pad) p = 0;
+}
+
+void QBVH::Node::setBounds(int i, const BoundingBox3f &bb)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        bounds[0][a][i] = bb.min[a];
+        bounds[1][a][i] = bb.max[a];
+    }
+}
+
+void QBVH::build() {
+    if(built) return;
+    built = true;
+
+    //Build the binary BVH over the same meshes
+    BVH bvh(m_method, m_optimizeTreelets);
+    for (auto mesh: meshes)
+    {
+        bvh.addMesh(mesh);
+    }
+    bvh.build();
+
+    //Collapse (& time) it into the QBVH
+    auto startT = std::chrono::high_resolution_clock::now();
+    nodes.clear();
+    leafTris.swap(bvh.leafTris);
+    const std::vector<BVH::LinearNode>& bin = bvh.nodes;
+    if (!leafTris.empty())
+    {
+        if (bin[0].isLeaf())
+        { //A single leaf, so the root only has one child
+            Node root;
+            root.setBounds(0, bin[0].AABB);
+            root.child[0] = bin[0].offset;
+            root.triCount[0] = bin[0].triCount;
+            nodes.push_back(root);
+        }
+        else
+        {
+            nodes.reserve(bin.size() / 2 + 1);
+            collapse(bin, 0);
+        }
+    }
+    auto endT = std::chrono::high_resolution_clock::now();
+    auto durT = std::chrono::duration_cast<std::chrono::milliseconds>(endT-startT);
+
+    //Print some information
+    std::cout << "Acceleration Structure: QBVH" << std::endl;
+    std::cout << "Nodes: " << nodes.size() << ", Tree Stored Tris: " << leafTris.size() << std::endl;
+    std::cout << "Node Memory: " << memString(nodes.size() * sizeof(Node)) << std::endl;
+    std::cout << "QBVH Collapse Time: " << durT.count() << " MS" << endl;
+
+    //Store the triangles themselves in leaf order, if enabled
+    buildTriAccels();
+}
+
+uint32_t QBVH::collapse(const std::vector<BVH::LinearNode> &bin, uint32_t n)
+{
+    auto index = (uint32_t)nodes.size();
+    nodes.emplace_back();
+
+    Node q;
+    const BVH::LinearNode& bn = bin[n];
+    q.axes[0] = bn.dim;
+
+    //Each child of bn contributes its two children, or itself if it is a leaf
+    uint32_t slots[4];
+    bool used[4]{false, false, false, false};
+    uint32_t halves[2]{n + 1, bn.offset};
+    for (int h = 0; h < 2; ++h)
+    {
+        const BVH::LinearNode& c = bin[halves[h]];
+        if (c.isLeaf())
+        {
+            slots[2*h] = halves[h];
+            used[2*h] = true;
+        }
+        else
+        {
+            q.axes[1 + h] = c.dim;
+            slots[2*h] = halves[h] + 1;
+            slots[2*h + 1] = c.offset;
+            used[2*h] = used[2*h + 1] = true;
+        }
+    }
+
+    for (int i = 0; i < 4; ++i)
+    {
+        if (!used[i]) continue;
+
+        const BVH::LinearNode& c = bin[slots[i]];
+        q.setBounds(i, c.AABB);
+        if (c.isLeaf())
+        {
+            q.child[i] = c.offset;
+            q.triCount[i] = c.triCount;
+        }
+        else
+        {
+            q.child[i] = collapse(bin, slots[i]);
+        }
+    }
+
+    //(nodes may have been reallocated by the recursion)
+    nodes[index] = q;
+    return index;
+}
+
+/// A ray prepared for testing against the four child boxes of a node at once
+struct QBVHRay
+{
+    explicit QBVHRay(const Ray3f& ray)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            //(Use the reciprocal, so that a direction of -0 counts as negative)
+            sign[a] = ray.dRcp[a] < 0 ? 1 : 0;
+#if QBVH_SSE
+            o[a] = _mm_set1_ps(ray.o[a]);
+            inv[a] = _mm_set1_ps(ray.dRcp[a]);
+#else
+            o[a] = ray.o[a];
+            inv[a] = ray.dRcp[a];
+#endif
+        }
+    }
+
+    /// Tests the ray segment [mint, maxt] against the four child boxes of n.
+    /// \return A 4-bit mask of the children that were hit
+    int intersect(const QBVH::Node& n, float mint, float maxt) const
+    {
+#if QBVH_SSE
+        __m128 tmin = _mm_set1_ps(mint), tmax = _mm_set1_ps(maxt);
+        for (int a = 0; a < 3; ++a)
+        {
+            __m128 tNear = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.bounds[sign[a]][a]), o[a]), inv[a]);
+            __m128 tFar = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.bounds[1 - sign[a]][a]), o[a]), inv[a]);
+            //The running interval is the second operand, so NaNs (0 * inf, from a ray lying
+            //  in a slab's plane) leave it untouched
+            tmin = _mm_max_ps(tNear, tmin);
+            tmax = _mm_min_ps(tFar, tmax);
+        }
+        return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+        int mask = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            float tmin = mint, tmax = maxt;
+            for (int a = 0; a < 3; ++a)
+            {
+                float tNear = (n.bounds[sign[a]][a][i] - o[a]) * inv[a];
+                float tFar = (n.bounds[1 - sign[a]][a][i] - o[a]) * inv[a];
+                tmin = tNear > tmin ? tNear : tmin;
+                tmax = tFar < tmax ? tFar : tmax;
+            }
+            if (tmin <= tmax) mask |= 1 << i;
+        }
+        return mask;
+#endif
+    }
+
+#if QBVH_SSE
+    __m128 o[3], inv[3];
+#else
+    float o[3], inv[3];
+#endif
+    /// 1 if the direction is negative along an axis (so the near plane is the box max)
+    int sign[3];
+};
+
+QBVH::TriInd QBVH::rayIntersect(const nori::Ray3f &ray_, nori::Intersection &its, bool shadowRay) const
+{
+    if (leafTris.empty()) return {};
+
+    /// A stack entry: a node index, or a leaf's triangle range (count > 0)
+    struct Entry
+    {
+        uint32_t child;
+        uint32_t count;
+    };
+    Entry stack[STACK_SIZE];
+    ///Stack index
+    int si = 0;
+
+    TriInd closeTri = {};
+    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+    QBVHRay qray(ray);
+
+    stack[0] = {0, 0};
+    while(si >= 0)
+    {
+        Entry cur = stack[si];
+        --si;
+
+        if (cur.count > 0)
+        {
+            TriInd inter = leafRayTriIntersect(cur.child, cur.count, ray, its, shadowRay);
+            if(inter.isValid())
+            {
+                closeTri = inter;
+                if (shadowRay) return closeTri;
+            }
+            continue;
+        }
+
+        const Node& n = nodes[cur.child];
+        int mask = qray.intersect(n, ray.mint, ray.maxt);
+        if (mask == 0) continue;
+
+        //Near-first order from the direction signs along the collapsed split axes
+        int firstPair = qray.sign[n.axes[0]];
+        int order[4];
+        for (int p = 0; p < 2; ++p)
+        {
+            int pair = p == 0 ? firstPair : 1 - firstPair;
+            int first = qray.sign[n.axes[1 + pair]];
+            order[2*p] = 2*pair + first;
+            order[2*p + 1] = 2*pair + 1 - first;
+        }
+
+        //Push in reverse, so the nearest child is popped first
+        for (int k = 3; k >= 0; --k)
+        {
+            int c = order[k];
+            if (mask & (1 << c))
+            {
+                ++si;
+                stack[si] = {n.child[c], n.triCount[c]};
+            }
+        }
+    }
+
+    return closeTri;
+}
+
+QBVH::TriInd QBVH::leafRayTriIntersect(uint32_t start, uint32_t count, nori::Ray3f &ray, nori::Intersection &its,
+                                       bool shadowRay) const
+{
+    TriInd f = {};      // Triangle index of the closest intersection
+
+    /* Brute force search through all triangles */
+    for (uint32_t i = start; i < start + count; ++i) {
+        const TriInd &idx = leafTris[i];
+        float u, v, t;
+        if (leafTriIntersect(i, ray, u, v, t)) {
+            /* An intersection was found! Can terminate
+               immediately if this is a shadow ray query */
+            if (shadowRay)
+                return idx;
+            ray.maxt = its.t = t;
+            its.uv = Point2f(u, v);
+            its.mesh = meshes[idx.mesh];
+            f = idx;
+        }
+    }
+
+    return f;
+}
+
+NORI_NAMESPACE_END
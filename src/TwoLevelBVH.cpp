@@ -0,0 +1,233 @@
+//
+// A two-level BVH: one (bottom-level) BVH per unique mesh, and a top-level BVH over the
+//     instances of those meshes, each placed in the scene by its own transform.
+//
+
+#include "nori/TwoLevelBVH.h"
+
+#include <algorithm>
+#include <chrono>
+
+NORI_NAMESPACE_BEGIN
+
+TwoLevelBVH::~TwoLevelBVH()
+{
+    for (auto blas : blases)
+    {
+        delete blas;
+    }
+}
+
+void TwoLevelBVH::addInstance(Mesh *mesh, const Transform &toWorld)
+{
+    if(built) return;
+
+    //Share one BVH between all instances of the same mesh
+    auto it = std::find(blasMeshes.begin(), blasMeshes.end(), mesh);
+    auto blas = (uint32_t)(it - blasMeshes.begin());
+    if (it == blasMeshes.end())
+    {
+        blasMeshes.push_back(mesh);
+    }
+
+    Instance instance;
+    instance.blas = blas;
+    instance.toWorld = toWorld;
+    instance.toLocal = toWorld.inverse();
+    instance.bb = instanceBB(blas, toWorld);
+    instances.push_back(instance);
+
+    bbox.expandBy(instance.bb);
+}
+
+BoundingBox3f TwoLevelBVH::instanceBB(uint32_t blas, const Transform &toWorld) const
+{
+    //Transform the 8 corners of the mesh's own bounds
+    const BoundingBox3f& local = blasMeshes[blas]->getBoundingBox();
+    BoundingBox3f bb;
+    for (int c = 0; c < 8; ++c)
+    {
+        bb.expandBy(toWorld * local.getCorner(c));
+    }
+    return bb;
+}
+
+void TwoLevelBVH::build()
+{
+    if(built) return;
+
+    //Meshes added directly are single instances, as they are
+    for (auto mesh: meshes)
+    {
+        addInstance(mesh, Transform());
+    }
+    built = true;
+
+    auto startT = std::chrono::high_resolution_clock::now();
+
+    //Build the bottom level: one BVH per unique mesh
+    uint64_t storedTris = 0;
+    for (auto mesh: blasMeshes)
+    {
+        BVH* blas = new BVH(m_method);
+        blas->setPrecomputeTris(precomputeTris);
+        blas->addMesh(mesh);
+        blas->build();
+        blases.push_back(blas);
+        storedTris += mesh->getTriangleCount();
+    }
+
+    //& the top level over all instances
+    nodes.clear();
+    if (!instances.empty())
+    {
+        nodes.reserve(2 * instances.size());
+        buildTop(0, (uint32_t)instances.size());
+    }
+
+    auto endT = std::chrono::high_resolution_clock::now();
+    auto durT = std::chrono::duration_cast<std::chrono::milliseconds>(endT-startT);
+
+    uint64_t sceneTris = 0;
+    for (const auto& instance : instances)
+    {
+        sceneTris += blasMeshes[instance.blas]->getTriangleCount();
+    }
+
+    //Print some information
+    std::cout << "Acceleration Structure: Two-Level BVH" << std::endl;
+    std::cout << "Instances: " << instances.size() << ", Unique Meshes: " << blases.size()
+              << ", Top-Level Nodes: " << nodes.size() << std::endl;
+    std::cout << "Stored Tris: " << storedTris << ", Scene (Instanced) Tris: " << sceneTris << std::endl;
+    std::cout << "Two-Level BVH Construction Time: " << durT.count() << " MS" << endl;
+}
+
+uint32_t TwoLevelBVH::buildTop(uint32_t start, uint32_t end)
+{
+    BoundingBox3f bb, centers;
+    for (uint32_t i = start; i < end; ++i)
+    {
+        bb.expandBy(instances[i].bb);
+        centers.expandBy(instances[i].bb.getCenter());
+    }
+
+    auto index = (uint32_t)nodes.size();
+    if (end - start <= LEAF_INSTANCES)
+    {
+        nodes.push_back({bb, start, (uint16_t)(end - start), 0, 0});
+        return index;
+    }
+
+    //Split at the median instance along the axis where their centers spread the most
+    //  (instances are few and large, so a balanced tree works well here)
+    int dim = centers.getMajorAxis();
+    uint32_t mid = start + (end - start) / 2;
+    std::nth_element(instances.begin() + start, instances.begin() + mid, instances.begin() + end,
+                     [dim](const Instance& a, const Instance& b)
+                     {
+                         return a.bb.getCenter()[dim] < b.bb.getCenter()[dim];
+                     });
+
+    nodes.push_back({bb, 0, 0, (uint8_t)dim, 0});
+    //First child directly follows its parent
+    buildTop(start, mid);
+    uint32_t second = buildTop(mid, end);
+    nodes[index].offset = second;
+
+    return index;
+}
+
+void TwoLevelBVH::refit()
+{
+    if (!built) return;
+
+    for (auto blas : blases)
+    {
+        blas->refit();
+    }
+
+    bbox.reset();
+    for (auto& instance : instances)
+    {
+        instance.bb = instanceBB(instance.blas, instance.toWorld);
+        bbox.expandBy(instance.bb);
+    }
+
+    //Children always come after their parent, so walking backwards refits bottom-up
+    for (std::size_t i = nodes.size(); i-- > 0;)
+    {
+        BVH::LinearNode& n = nodes[i];
+        if (n.isLeaf())
+        {
+            n.AABB.reset();
+            for (uint32_t k = n.offset; k < n.offset + n.triCount; ++k)
+            {
+                n.AABB.expandBy(instances[k].bb);
+            }
+        }
+        else
+        {
+            n.AABB = nodes[i + 1].AABB;
+            n.AABB.expandBy(nodes[n.offset].AABB);
+        }
+    }
+}
+
+TwoLevelBVH::TriInd TwoLevelBVH::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const
+{
+    if (nodes.empty()) return {};
+
+    /// Indices into nodes
+    uint32_t stack[STACK_SIZE];
+    int si = 0;
+    stack[0] = 0;
+
+    TriInd closeTri = {};
+    Ray3f ray(ray_); /// Shortened to the closest hit so far, so farther instances are skipped
+
+    while (si >= 0)
+    {
+        uint32_t curInd = stack[si];
+        const BVH::LinearNode& cur = nodes[curInd];
+        --si;
+
+        if (!cur.AABB.rayIntersect(ray)) continue;
+
+        if (cur.isLeaf())
+        {
+            for (uint32_t k = cur.offset; k < cur.offset + cur.triCount; ++k)
+            {
+                const Instance& instance = instances[k];
+                if (!instance.bb.rayIntersect(ray)) continue;
+
+                //Trace the ray in the mesh's own space (the direction is not renormalized,
+                //  so distances along it stay the same as in world space)
+                TriInd inter = blases[instance.blas]->rayIntersect(instance.toLocal * ray, its, shadowRay);
+                if (inter.isValid())
+                {
+                    closeTri = TriInd(k, inter.i);
+                    if (shadowRay) return closeTri;
+                    ray.maxt = its.t;
+                }
+            }
+        }
+        else
+        {
+            //Add the two child nodes in order (the first child directly follows cur)
+            if (ray.d[cur.dim] >= 0)
+            {
+                stack[++si] = cur.offset;
+                stack[++si] = curInd + 1;
+            }
+            else
+            {
+                stack[++si] = curInd + 1;
+                stack[++si] = cur.offset;
+            }
+        }
+    }
+
+    return closeTri;
+}
+
+NORI_NAMESPACE_END
@@ -2,31 +2,66 @@
 #include <Eigen/Geometry>
 #include <chrono>
 #include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 
 #include "nori/Octree.h"
 #include "nori/KDTree.h"
 #include "nori/BVH.h"
+#include "nori/QBVH.h"
+#include "nori/BVH8.h"
+#include "nori/TwoLevelBVH.h"
+#include "nori/Grid.h"
+#include "nori/BIH.h"
+#include <nori/instance.h>
+
+//The number of rays of a batch that each parallel task traces
+#define BATCH_GRAIN 4096
 
 NORI_NAMESPACE_BEGIN
 
 Accel::Accel() {
 	//m_tree = new KDTree(KDTree::BruteForce); //This is just for testing bruteforce intersection checking
     //m_tree = new Octree();
+    //m_tree = new Octree(true);
     //m_tree = new KDTree(KDTree::Midpoint);
     //m_tree = new KDTree(KDTree::SAHFull); 
+    //m_tree = new KDTree(KDTree::SAHFull, true); //Clips triangles to the nodes (fewer duplicated triangles)
+    //static_cast<KDTree*>(m_tree)->setRopes(true); //(After any of the above) Stackless traversal from leaf to leaf
     //m_tree = new BVH(BVH::SAHFull);
+    //m_tree = new BVH(BVH::LBVH); //Near-instant construction (for previews), at the cost of render time
+    //m_tree = new BVH(BVH::SBVH); //Spatial splits, for scenes with large or long overlapping triangles
+    //m_tree = new BVH(BVH::LBVH, true); //Fast build, with treelet restructuring to recover most of the SAH quality
+    //m_tree = new QBVH(BVH::SAHBuckets);
+    //m_tree = new BVH8(BVH::SAHBuckets);
+    //m_tree = new TwoLevelBVH(BVH::SAHBuckets); //Needed for scenes with instanced meshes
+    //m_tree = new BIH(BVH::SAHBuckets); //A third of the BVH's node memory
+    //m_tree = new Grid(); //Linear-time construction, for evenly spread triangles (Grid(true): two-level)
     m_tree = new BVH(BVH::SAHBuckets);
+
+    //Store the triangles themselves in the tree for faster intersection (more memory)
+    //m_tree->setPrecomputeTris(true);
 }
 
 
 void Accel::addMesh(Mesh *mesh) {
-    m_tree->addMesh(mesh);
+    if (mesh->getInstances().empty()) {
+        m_tree->addMesh(mesh);
+        return;
+    }
+
+    /* Place the mesh once per instance instead */
+    for (auto instance : mesh->getInstances())
+        m_tree->addInstance(mesh, instance->getToWorld());
 }
 
 void Accel::build() {
     m_tree->build();
 }
 
+void Accel::refit() {
+    m_tree->refit();
+}
+
 bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const {
 
     //Use the node tri intersect function on the octtree
@@ -35,62 +70,100 @@ bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) c
 
     if (foundIntersection && shadowRay) return true;
 
-    if (foundIntersection) {
-        uint32_t f = inter.i;
-
-        /* At this point, we now know that there is an intersection,
-           and we know the triangle index of the closest such intersection.
-
-           The following computes a number of additional properties which
-           characterize the intersection (normals, texture coordinates, etc..)
-        */
-
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
-
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
-
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
-
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
-
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
-
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
-        } else {
-            its.shFrame = its.geoFrame;
+    if (foundIntersection)
+        fillIntersection(inter, its);
+
+    return foundIntersection;
+}
+
+void Accel::rayIntersectPacket(const RayPacket &packet, Intersection *its, bool *hit, bool shadowRay) const {
+    AccelTree::TriInd tris[RayPacket::MAX_SIZE];
+    m_tree->rayIntersectPacket(packet, its, tris, shadowRay);
+
+    for (int k = 0; k < packet.size; ++k) {
+        hit[k] = tris[k].isValid();
+        if (hit[k] && !shadowRay)
+            fillIntersection(tris[k], its[k]);
+    }
+}
+
+void Accel::rayIntersectBatch(const RayBatch &rays, Intersection *its, bool *hit, bool shadowRay) const {
+    std::vector<AccelTree::TriInd> tris(rays.size);
+
+    tbb::parallel_for(tbb::blocked_range<std::size_t>(0, rays.size, BATCH_GRAIN),
+                      [&](const tbb::blocked_range<std::size_t> &range) {
+        m_tree->rayIntersectBatch(rays.slice(range.begin(), range.end()),
+                                  its ? its + range.begin() : nullptr,
+                                  tris.data() + range.begin(), shadowRay);
+
+        for (std::size_t k = range.begin(); k < range.end(); ++k) {
+            hit[k] = tris[k].isValid();
+            if (hit[k] && !shadowRay)
+                fillIntersection(tris[k], its[k]);
         }
+    });
+}
+
+void Accel::fillIntersection(const AccelTree::TriInd &tri, Intersection &its) const {
+    /* At this point, we now know that there is an intersection,
+       and we know the triangle index of the closest such intersection.
+
+       The following computes a number of additional properties which
+       characterize the intersection (normals, texture coordinates, etc..)
+    */
+
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1-its.uv.sum(), its.uv;
+
+    /* References to all relevant mesh buffers */
+    const Mesh *mesh   = its.mesh;
+    const MatrixXf &V  = mesh->getVertexPositions();
+    const MatrixXf &N  = mesh->getVertexNormals();
+    const MatrixXf &UV = mesh->getVertexTexCoords();
+    const MatrixXu &F  = mesh->getIndices();
+
+    /* Vertex indices of the triangle */
+    uint32_t f = tri.i;
+    uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+
+    Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (UV.size() > 0)
+        its.uv = bary.x() * UV.col(idx0) +
+            bary.y() * UV.col(idx1) +
+            bary.z() * UV.col(idx2);
+
+    /* Compute the geometry frame */
+    its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+
+    if (N.size() > 0) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        its.shFrame = Frame(
+            (bary.x() * N.col(idx0) +
+             bary.y() * N.col(idx1) +
+             bary.z() * N.col(idx2)).normalized());
+    } else {
+        its.shFrame = its.geoFrame;
     }
 
-    return foundIntersection;
+    /* Instanced triangles were hit in their mesh's own space,
+       so bring the hit into world space */
+    if (const Transform *toWorld = m_tree->getInstanceTransform(tri)) {
+        its.p = *toWorld * its.p;
+        its.geoFrame = Frame((*toWorld * its.geoFrame.n).normalized());
+        its.shFrame = Frame((*toWorld * its.shFrame.n).normalized());
+    }
 }
 
 NORI_NAMESPACE_END
@@ -0,0 +1,11 @@
+//
+// Registers MeshInstance with the object factory (see instance.h).
+//
+
+#include <nori/instance.h>
+
+NORI_NAMESPACE_BEGIN
+
+NORI_REGISTER_CLASS(MeshInstance, "instance");
+
+NORI_NAMESPACE_END
@@ -35,6 +35,14 @@ using namespace nori;
 
 static int threadCount = -1;
 
+/// Whether camera rays are traced in packets built from small pixel tiles
+/// (only used if the integrator supports it, see Integrator::LiPrimary)
+#define PACKET_TRACING true
+/// The width and height (in pixels) of the tile that a packet is built from
+#define PACKET_TILE 4
+
+static_assert(PACKET_TILE * PACKET_TILE <= RayPacket::MAX_SIZE, "A pixel tile must fit into one ray packet");
+
 static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
     const Camera *camera = scene->getCamera();
     const Integrator *integrator = scene->getIntegrator();
@@ -45,6 +53,52 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     /* Clear the block contents */
     block.clear();
 
+#if PACKET_TRACING
+    if (integrator->supportsPrimaryPackets()) {
+        /* For each pixel tile and pixel sample, trace the camera rays
+           of all pixels in the tile together as one packet */
+        for (int ty=0; ty<size.y(); ty += PACKET_TILE) {
+            for (int tx=0; tx<size.x(); tx += PACKET_TILE) {
+                int yEnd = std::min(ty + PACKET_TILE, size.y());
+                int xEnd = std::min(tx + PACKET_TILE, size.x());
+
+                for (uint32_t i=0; i<sampler->getSampleCount(); ++i) {
+                    RayPacket packet;
+                    Point2f pixelSamples[RayPacket::MAX_SIZE];
+                    Color3f values[RayPacket::MAX_SIZE];
+
+                    /* Sample a ray from the camera for every pixel in the tile */
+                    for (int y=ty; y<yEnd; ++y) {
+                        for (int x=tx; x<xEnd; ++x) {
+                            Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+                            Point2f apertureSample = sampler->next2D();
+
+                            Ray3f ray;
+                            values[packet.size] = camera->sampleRay(ray, pixelSample, apertureSample);
+                            pixelSamples[packet.size] = pixelSample;
+                            packet.add(ray);
+                        }
+                    }
+
+                    /* Find the first intersections of the whole packet */
+                    Intersection its[RayPacket::MAX_SIZE];
+                    bool hit[RayPacket::MAX_SIZE];
+                    scene->rayIntersectPacket(packet, its, hit);
+
+                    for (int k=0; k<packet.size; ++k) {
+                        /* Compute the incident radiance */
+                        Color3f value = values[k] * integrator->LiPrimary(scene, sampler, packet.rays[k], its[k], hit[k]);
+
+                        /* Store in the image block */
+                        block.put(pixelSamples[k], value);
+                    }
+                }
+            }
+        }
+        return;
+    }
+#endif
+
     /* For each pixel and pixel sample sample */
     for (int y=0; y<size.y(); ++y) {
         for (int x=0; x<size.x(); ++x) {
@@ -20,6 +20,7 @@
 #include <nori/bbox.h>
 #include <nori/bsdf.h>
 #include <nori/emitter.h>
+#include <nori/instance.h>
 #include <nori/warp.h>
 #include <Eigen/Geometry>
 
@@ -30,6 +31,8 @@ Mesh::Mesh() { }
 Mesh::~Mesh() {
     delete m_bsdf;
     delete m_emitter;
+    for (auto instance : m_instances)
+        delete instance;
 }
 
 void Mesh::activate() {
@@ -94,6 +97,23 @@ BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
     return result;
 }
 
+void Mesh::setVertexPositions(const MatrixXf &V, const MatrixXf &N) {
+    if (V.rows() != 3 || V.cols() != m_V.cols())
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertex positions, got %i!",
+                            m_V.cols(), V.cols());
+    if (N.size() > 0 && (N.rows() != 3 || N.cols() != m_V.cols()))
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertex normals, got %i!",
+                            m_V.cols(), N.cols());
+
+    m_V = V;
+    if (N.size() > 0)
+        m_N = N;
+
+    m_bbox.reset();
+    for (uint32_t i=0; i<m_V.cols(); ++i)
+        m_bbox.expandBy(m_V.col(i));
+}
+
 Point3f Mesh::getCentroid(uint32_t index) const {
     return (1.0f / 3.0f) *
         (m_V.col(m_F(0, index)) +
@@ -119,6 +139,10 @@ void Mesh::addChild(NoriObject *obj) {
             }
             break;
 
+        case EInstance:
+            m_instances.push_back(static_cast<MeshInstance *>(obj));
+            break;
+
         default:
             throw NoriException("Mesh::addChild(<%s>) is not supported!",
                                 classTypeName(obj->getClassType()));
@@ -132,13 +156,15 @@ std::string Mesh::toString() const {
         "  vertexCount = %i,\n"
         "  triangleCount = %i,\n"
         "  bsdf = %s,\n"
-        "  emitter = %s\n"
+        "  emitter = %s,\n"
+        "  instances = %i\n"
         "]",
         m_name,
         m_V.cols(),
         m_F.cols(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
-        m_emitter ? indent(m_emitter->toString()) : std::string("null")
+        m_emitter ? indent(m_emitter->toString()) : std::string("null"),
+        m_instances.size()
     );
 }
 